@@ -0,0 +1,339 @@
+#ifndef FAR_H
+#define FAR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*! \def le32_to_cpu(x)
+ *
+ *  Convert a 32-bit value from little-endian to native
+ */
+/*! \def cpu_to_le32(x)
+ *
+ *  Convert a 32-bit value from native to little-endian
+ */
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define le32_to_cpu(x) (x)
+#define cpu_to_le32(x) (x)
+#elif __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define le32_to_cpu(x) __builtin_bswap32(x)
+#define cpu_to_le32(x) __builtin_bswap32(x)
+#else
+#error "You are neither big nor little endian"
+#endif
+
+/*! Magic macro */
+#define MAGIC(a,b,c,d) ((a) | ((b) << 8) | ((c) << 16) | ((d) << 24))
+
+/*! FAR magic */
+#define FAR_MAGIC      MAGIC('F', 'A', 'R', '\0')
+
+/*! FAR archive version */
+typedef enum
+{
+  FAR_VERSION_0 = 0, /*!< root directory entries follow the header */
+  FAR_VERSION_1 = 1, /*!< extended header with flags and sections */
+} far_version_t;
+
+/*! FARFS entry type */
+typedef enum
+{
+  FAR_FILE_TYPE = 0, /*!< File entry */
+  FAR_DIR_TYPE  = 1, /*!< Directory entry */
+} far_type_t;
+
+/*! FAR entry flag: dataoff points to the file's FARchunklist_t instead of its
+ *  data (version 1, with a FAR_SECTION_CHUNKS section)
+ */
+#define FAR_ENTRY_CHUNKED (1 << 8)
+
+/*! FAR entry flag: dataoff points to the file's FARzstd_t instead of its
+ *  data (version 1, with a FAR_SECTION_DICT section)
+ */
+#define FAR_ENTRY_ZSTD    (1 << 9)
+
+/*! FAR entry flag: dataoff is the file's offset into the solid stream
+ *  instead of the archive (version 1, with a FAR_SECTION_BLOCKS section)
+ */
+#define FAR_ENTRY_SOLID   (1 << 10)
+
+/*! FAR entry flag: dataoff points among the names, where the file's data
+ *  follows its own name, so reading it touches no page beyond the
+ *  metadata (version 1)
+ */
+#define FAR_ENTRY_INLINE  (1 << 11)
+
+/*! FAR entry */
+typedef struct FARentry_t
+{
+  uint32_t flags;   /*!< lower byte is far_type_t, upper bytes are FAR_ENTRY_* flags */
+  uint32_t nameoff; /*!< offset (from header) to name */
+  uint32_t dataoff; /*!< offset (from header) to data */
+  uint32_t size;    /*!< number of bytes (for file) or number of entries (for directory) */
+} FARentry_t;
+
+/*! FAR header
+ *
+ *  In a version 0 archive the entry table immediately follows this header,
+ *  starting with the root directory entries. Version 1 archives continue
+ *  with the rest of FARheader1_t.
+ */
+typedef struct FARheader_t
+{
+  uint32_t   magic;       /*!< magic marker "FAR\0" */
+  uint32_t   version;     /*!< archive version */
+  uint32_t   nentries;    /*!< total number of entries */
+  uint32_t   namesize;    /*!< ??? */
+  uint32_t   rootentries; /*!< number of entries in root directory */
+} FARheader_t;
+
+/*! FAR header flag: every directory's children are sorted bytewise by name */
+#define FAR_HEADER_SORTED (1 << 0)
+
+/*! FAR header flag: nameoff points to FARname_t records instead of strings */
+#define FAR_HEADER_FRONTCODED (1 << 1)
+
+/*! FAR section type */
+typedef enum
+{
+  FAR_SECTION_PHASH    = 1, /*!< FARphash_t perfect hash over full paths */
+  FAR_SECTION_NAMEHASH = 2, /*!< far_name_hash() of every entry's name */
+  FAR_SECTION_CHUNKS   = 3, /*!< FARchunk_t of every stored chunk */
+  FAR_SECTION_DICT     = 4, /*!< zstd dictionary for FAR_ENTRY_ZSTD files */
+  FAR_SECTION_BLOCKS   = 5, /*!< FARblock_t of every solid block */
+} far_section_t;
+
+/*! Longest name a FARname_t can hold */
+#define FAR_NAME_MAX     255
+/*! Entries whose table index is a multiple of this have a prefix of 0 */
+#define FAR_NAME_RESTART 16
+
+/*! FAR front-coded name record
+ *
+ *  An entry's name is the first prefix bytes of the previous entry's name
+ *  followed by the suffix. The first child of every directory and every
+ *  FAR_NAME_RESTART-th entry of the table have a prefix of 0, so any name
+ *  can be decoded from at most FAR_NAME_RESTART records.
+ */
+typedef struct FARname_t
+{
+  uint8_t prefix;   /*!< bytes shared with the previous entry's name */
+  uint8_t length;   /*!< length of suffix */
+  char    suffix[]; /*!< rest of the name (not NUL-terminated) */
+} FARname_t;
+
+/*! FAR section descriptor */
+typedef struct FARsection_t
+{
+  uint32_t type;   /*!< far_section_t */
+  uint32_t offset; /*!< offset (from header) to section */
+  uint32_t size;   /*!< size of section in bytes */
+} FARsection_t;
+
+/*! FAR chunk, a piece of file data stored once and shared by every file
+ *  that contains it
+ */
+typedef struct FARchunk_t
+{
+  uint32_t offset; /*!< offset (from header) to data */
+  uint32_t size;   /*!< number of bytes */
+} FARchunk_t;
+
+/*! FAR chunk reference */
+typedef struct FARchunkref_t
+{
+  uint32_t chunk; /*!< index into the chunk section */
+  uint32_t end;   /*!< offset into the file where this chunk ends */
+} FARchunkref_t;
+
+/*! FAR chunk list of a FAR_ENTRY_CHUNKED file
+ *
+ *  The chunks make up the file in order, so a file offset is found by
+ *  binary searching the ends. The last end is the file size.
+ */
+typedef struct FARchunklist_t
+{
+  uint32_t      count;  /*!< number of references */
+  FARchunkref_t refs[]; /*!< references, in file order */
+} FARchunklist_t;
+
+/*! FAR compressed data of a FAR_ENTRY_ZSTD file
+ *
+ *  A zstd frame compressed with the archive's dictionary. The entry's size
+ *  is still the size of the file; the record is always smaller than that.
+ */
+typedef struct FARzstd_t
+{
+  uint32_t size;   /*!< number of bytes in frame */
+  uint8_t  frame[]; /*!< zstd frame */
+} FARzstd_t;
+
+/*! Largest solid block, uncompressed */
+#define FAR_SOLID_MAX (128 << 10)
+
+/*! FAR solid block, a run of small files compressed together as one zstd
+ *  frame
+ *
+ *  The blocks' contents, one after the other, make up the solid stream. A
+ *  FAR_ENTRY_SOLID file lies within a single block, so a block is found by
+ *  binary searching the ends.
+ */
+typedef struct FARblock_t
+{
+  uint32_t offset; /*!< offset (from header) to frame */
+  uint32_t size;   /*!< number of bytes in frame */
+  uint32_t end;    /*!< offset into the solid stream where this block ends */
+} FARblock_t;
+
+/*! FAR version 1 header */
+typedef struct FARheader1_t
+{
+  FARheader_t  common;     /*!< fields shared with version 0 */
+  uint32_t     flags;      /*!< FAR_HEADER_* flags */
+  uint32_t     entryoff;   /*!< offset (from header) to entry table */
+  uint32_t     nsections;  /*!< number of section descriptors */
+  FARsection_t sections[]; /*!< section descriptors */
+} FARheader1_t;
+
+/*! FAR perfect hash slot */
+typedef struct FARphslot_t
+{
+  uint32_t slot;    /*!< entry table index + 1 */
+  uint32_t parent;  /*!< slot of parent; 0 is the root directory */
+  uint32_t pathoff; /*!< offset (from header) to full path, without leading '/' */
+} FARphslot_t;
+
+/*! FAR perfect hash section
+ *
+ *  Maps the full path of every entry to a unique slot without probing: a
+ *  key hashes to a bucket, and the bucket's pilot displaces it to its slot.
+ *  The nbuckets pilots are followed by nslots FARphslot_t.
+ */
+typedef struct FARphash_t
+{
+  uint32_t seed;     /*!< hash seed */
+  uint32_t nbuckets; /*!< number of buckets */
+  uint32_t nslots;   /*!< number of slots (equal to number of entries) */
+  uint32_t pilots[]; /*!< pilot for each bucket */
+} FARphash_t;
+
+/*! Initial value for far_hash_more() */
+#define FAR_HASH_INIT UINT64_C(0xcbf29ce484222325)
+
+/*! Continue a hash over more data
+ *
+ *  @param[in] hash Hash so far, starting from FAR_HASH_INIT
+ *  @param[in] data Data to hash
+ *  @param[in] len  Length of data
+ *
+ *  @returns 64-bit FNV-1a hash of everything so far
+ */
+static inline uint64_t
+far_hash_more(uint64_t   hash,
+              const char *data,
+              size_t     len)
+{
+  while(len-- > 0)
+  {
+    hash ^= (unsigned char)*data++;
+    hash *= UINT64_C(0x100000001b3);
+  }
+
+  return hash;
+}
+
+/*! Hash a name
+ *
+ *  @param[in] name Name to hash (not necessarily NUL-terminated)
+ *  @param[in] len  Length of name
+ *
+ *  @returns 64-bit FNV-1a hash of name
+ */
+static inline uint64_t
+far_hash(const char *name,
+         size_t     len)
+{
+  return far_hash_more(FAR_HASH_INIT, name, len);
+}
+
+/*! Hash a name for the name hash section
+ *
+ *  @param[in] name Name to hash (not necessarily NUL-terminated)
+ *  @param[in] len  Length of name
+ *
+ *  @returns 32-bit hash of name
+ */
+static inline uint32_t
+far_name_hash(const char *name,
+              size_t     len)
+{
+  uint64_t hash = far_hash(name, len);
+
+  return hash ^ (hash >> 32);
+}
+
+/*! Scramble the bits of a 64-bit value
+ *
+ *  @param[in] x Value to scramble
+ *
+ *  @returns scrambled value
+ */
+static inline uint64_t
+far_mix64(uint64_t x)
+{
+  x ^= x >> 33;
+  x *= UINT64_C(0xff51afd7ed558ccd);
+  x ^= x >> 33;
+  x *= UINT64_C(0xc4ceb9fe1a85ec53);
+  x ^= x >> 33;
+
+  return x;
+}
+
+/*! Hash a path for the perfect hash
+ *
+ *  @param[in] path Path to hash, without leading '/'
+ *  @param[in] len  Length of path
+ *  @param[in] seed Hash seed
+ *
+ *  @returns hash of path
+ */
+static inline uint64_t
+far_phash_key(const char *path,
+              size_t     len,
+              uint32_t   seed)
+{
+  return far_mix64(far_hash(path, len) ^ seed);
+}
+
+/*! Get the perfect hash bucket for a key
+ *
+ *  @param[in] key      Key hash
+ *  @param[in] nbuckets Number of buckets
+ *
+ *  @returns bucket index
+ */
+static inline uint32_t
+far_phash_bucket(uint64_t key,
+                 uint32_t nbuckets)
+{
+  return (key >> 32) % nbuckets;
+}
+
+/*! Get the perfect hash slot for a key
+ *
+ *  @param[in] key    Key hash
+ *  @param[in] pilot  Pilot of the key's bucket
+ *  @param[in] nslots Number of slots
+ *
+ *  @returns slot index
+ */
+static inline uint32_t
+far_phash_slot(uint64_t key,
+               uint32_t pilot,
+               uint32_t nslots)
+{
+  return (key ^ far_mix64(pilot)) % nslots;
+}
+
+#endif /* FAR_H */
@@ -1,39 +1,26 @@
+/* O_DIRECT, preadv2 */
+#define _GNU_SOURCE
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <inttypes.h>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <fuse.h>
 #include <fuse_opt.h>
+#include <zstd.h>
 
-/*! \def le32_to_cpu(x)
- *
- *  Convert a 32-bit value from little-endian to native
- */
-#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-#define le32_to_cpu(x) (x)
-#elif __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
-#define le32_to_cpu(x) __builtin_bswap32(x)
-#else
-#error "You are neither big nor little endian"
-#endif
-
-/*! Magic macro */
-#define MAGIC(a,b,c,d) ((a) | ((b) << 8) | ((c) << 16) | ((d) << 24))
-
-/*! FAR magic */
-#define FAR_MAGIC      MAGIC('F', 'A', 'R', '\0')
-
-/*! FARFS entry type */
-typedef enum
-{
-  FAR_FILE_TYPE = 0, /*!< File entry */
-  FAR_DIR_TYPE  = 1, /*!< Directory entry */
-} far_type_t;
+#include "far.h"
 
 /*! FARFS directory mode (dr-xr-xr-x) */
 #define FAR_DIR_MODE  (S_IRUSR|S_IXUSR|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH|S_IFDIR)
@@ -43,6 +30,113 @@ typedef enum
 /*! FAR file name */
 static const char *far_file = NULL;
 
+/*! FARFS mount options */
+typedef struct far_options_t
+{
+  int immutable; /*!< archive never changes; let the kernel cache everything */
+  int stats;     /*!< count requests; see user.farfs.stats on the root */
+  int icase;     /*!< match names case-insensitively */
+  char *index_cache; /*!< sidecar file caching the mount-time index */
+  unsigned mount_threads; /*!< threads validating and indexing at mount (default: one per CPU) */
+  char *record;      /*!< file to record the startup read profile to */
+  unsigned record_time; /*!< seconds after mount to record reads for */
+  char *replay;      /*!< startup read profile to prefetch at mount */
+  unsigned long dir_prefetch; /*!< bytes of file data to prefetch on opendir */
+  unsigned long seq_prefetch; /*!< bytes of the next sibling to prefetch on in-order opens */
+  char *backend;     /*!< how file data is read: "mmap" or "direct" */
+  unsigned long cache_size; /*!< block cache size in bytes */
+  unsigned long mem_limit; /*!< memory budget shared by all caches in bytes */
+  unsigned io_threads; /*!< threads reading data that is not in memory */
+  unsigned prefetch_depth; /*!< I/O threads that may prefetch at once */
+  int negative_timeout; /*!< libfuse's negative_timeout was given */
+} far_options_t;
+
+/*! FARFS mount options */
+static far_options_t far_options;
+
+/*! Describe a FARFS mount option */
+#define FAR_OPT(t, p, v) { t, offsetof(far_options_t, p), v }
+
+/*! FARFS mount option templates */
+static const struct fuse_opt far_opts[] =
+{
+  FAR_OPT("immutable", immutable, 1),
+  FAR_OPT("stats",     stats,     1),
+  FAR_OPT("icase",     icase,     1),
+  FAR_OPT("index_cache=%s",   index_cache,   0),
+  FAR_OPT("mount_threads=%u", mount_threads, 0),
+  FAR_OPT("record=%s",        record,        0),
+  FAR_OPT("record_time=%u",   record_time,   0),
+  FAR_OPT("replay=%s",        replay,        0),
+  FAR_OPT("dir_prefetch=%lu", dir_prefetch,  0),
+  FAR_OPT("seq_prefetch=%lu", seq_prefetch,  0),
+  FAR_OPT("backend=%s",       backend,       0),
+  FAR_OPT("cache_size=%lu",   cache_size,    0),
+  FAR_OPT("mem_limit=%lu",    mem_limit,     0),
+  FAR_OPT("io_threads=%u",    io_threads,    0),
+  FAR_OPT("prefetch_depth=%u", prefetch_depth, 0),
+  FAR_OPT("negative_timeout=", negative_timeout, 1),
+  FUSE_OPT_KEY("negative_timeout=", FUSE_OPT_KEY_KEEP),
+  FUSE_OPT_END,
+};
+
+/*! Most threads used at mount */
+#define FAR_MAX_MOUNT_THREADS 256
+/*! Items per mount-time work chunk (a multiple of FAR_NAME_RESTART) */
+#define FAR_JOB_CHUNK         65536
+
+/*! Default startup read profile window (seconds) */
+#define FAR_RECORD_TIME 30
+
+/*! Kernel cache timeout in immutable mode (seconds) */
+#define FAR_IMMUTABLE_TIMEOUT 86400.0
+
+/*! FARFS request counters */
+typedef enum
+{
+  FAR_STAT_GETATTR,    /*!< getattr requests */
+  FAR_STAT_OPEN,       /*!< open requests */
+  FAR_STAT_READ,       /*!< read requests */
+  FAR_STAT_READ_BYTES, /*!< bytes read */
+  FAR_STAT_OPENDIR,    /*!< opendir requests */
+  FAR_STAT_READDIR,    /*!< readdir requests */
+  FAR_STAT_PREFETCH,   /*!< prefetch hints issued */
+  FAR_STAT_PREFETCH_BYTES, /*!< bytes prefetched */
+  FAR_STAT_CACHE_HIT,  /*!< block cache hits */
+  FAR_STAT_CACHE_MISS, /*!< block cache misses */
+  FAR_STAT_CACHE_EVICT, /*!< block cache evictions */
+  FAR_STAT_CACHE_WAIT, /*!< block cache requests that waited for another's fill */
+  FAR_STAT_IO_POOL,    /*!< reads handed to the I/O pool */
+  FAR_STAT_PREFETCH_DROP, /*!< prefetches dropped because the queue was full */
+  FAR_STAT_PREFETCH_CANCEL, /*!< prefetches cancelled before they finished */
+  FAR_STAT_MEM_PRESSURE, /*!< memory pressure events */
+  FAR_STAT_MAX,        /*!< number of counters */
+} far_stat_t;
+
+/*! FARFS request counter names */
+static const char * const far_stat_names[FAR_STAT_MAX] =
+{
+  [FAR_STAT_GETATTR]    = "getattr",
+  [FAR_STAT_OPEN]       = "open",
+  [FAR_STAT_READ]       = "read",
+  [FAR_STAT_READ_BYTES] = "read_bytes",
+  [FAR_STAT_OPENDIR]    = "opendir",
+  [FAR_STAT_READDIR]    = "readdir",
+  [FAR_STAT_PREFETCH]   = "prefetch",
+  [FAR_STAT_PREFETCH_BYTES] = "prefetch_bytes",
+  [FAR_STAT_CACHE_HIT]  = "cache_hit",
+  [FAR_STAT_CACHE_MISS] = "cache_miss",
+  [FAR_STAT_CACHE_EVICT] = "cache_evict",
+  [FAR_STAT_CACHE_WAIT] = "cache_wait",
+  [FAR_STAT_IO_POOL]    = "io_pool",
+  [FAR_STAT_PREFETCH_DROP] = "prefetch_drop",
+  [FAR_STAT_PREFETCH_CANCEL] = "prefetch_cancel",
+  [FAR_STAT_MEM_PRESSURE] = "mem_pressure",
+};
+
+/*! FARFS request counter values */
+static uint64_t far_stats[FAR_STAT_MAX];
+
 /*! FAR file last access time */
 static time_t far_atime;
 /*! FAR file last modification time */
@@ -52,49 +146,391 @@ static time_t far_ctime;
 
 /*! FAR file mmap address */
 static void   *far_mapping;
+/*! FAR file descriptor, kept open so file data can be spliced */
+static int    far_fd = -1;
 
-/*! FAR entry */
-typedef struct FARentry_t
+/*! Startup read profile being recorded, until the window closes */
+static FILE            *far_record_fp = NULL;
+/*! Temporary name of the profile being recorded */
+static char            *far_record_tmp = NULL;
+/*! Lock protecting far_record_fp and the pending record */
+static pthread_mutex_t far_record_lock = PTHREAD_MUTEX_INITIALIZER;
+/*! When recording stops */
+static struct timespec far_record_end;
+/*! Pending record, grown while reads continue where it left off */
+static struct
 {
-  uint32_t flags;   /*!< flags; currently lower byte is far_type_t, upper bytes unused */
-  uint32_t nameoff; /*!< offset (from header) to name */
-  uint32_t dataoff; /*!< offset (from header) to data */
-  uint32_t size;    /*!< number of bytes (for file) or number of entries (for directory) */
-} FARentry_t;
+  size_t slot;   /*!< slot of file read */
+  off_t  offset; /*!< offset into file */
+  size_t size;   /*!< bytes read */
+} far_record_last;
 
-/*! FAR header */
-typedef struct FARheader_t
+/*! Startup read profile being replayed */
+static FILE      *far_replay_fp = NULL;
+/*! Replay thread */
+static pthread_t far_replay_thread;
+/*! Set to stop the replay thread early */
+static int       far_replay_stop = 0;
+
+/*! Number of directories whose open order is tracked at once */
+#define FAR_SEQ_BUCKETS 1024
+
+/*! Last file opened in recently used directories, as parent slot << 32 |
+ *  (child index + 1); 0 is an empty bucket
+ */
+static uint64_t far_seq[FAR_SEQ_BUCKETS];
+
+/*! Whether file data is read with O_DIRECT through the block cache */
+static int    far_direct = 0;
+/*! FAR file descriptor opened with O_DIRECT (backend=direct) */
+static int    far_direct_fd = -1;
+
+/*! Block cache block size */
+#define FAR_BLOCK_SIZE     (128 << 10)
+/*! O_DIRECT buffer and offset alignment */
+#define FAR_DIRECT_ALIGN   4096
+/*! Default block cache size (64 MiB) */
+#define FAR_CACHE_SIZE     (64 << 20)
+/*! Block cache keys of decompressed solid blocks; archive blocks are
+ *  numbered from 0. A solid block is never larger than a cache block.
+ */
+#define FAR_SOLID_KEY      (UINT64_C(1) << 63)
+
+/*! ARC lists */
+typedef enum
+{
+  FAR_ARC_T1,  /*!< resident, seen once recently */
+  FAR_ARC_T2,  /*!< resident, seen at least twice recently */
+  FAR_ARC_B1,  /*!< ghosts evicted from T1 */
+  FAR_ARC_B2,  /*!< ghosts evicted from T2 */
+  FAR_ARC_MAX, /*!< number of lists */
+} far_arc_t;
+
+/*! Block cache block */
+typedef struct far_block_t
+{
+  uint64_t           key;   /*!< block number in the archive, or FAR_SOLID_KEY | solid block */
+  char               *data; /*!< block data; NULL for a ghost or a failed fill */
+  size_t             size;  /*!< valid bytes of data */
+  unsigned           pins;  /*!< readers using data; pinned blocks stay */
+  int                loading; /*!< a thread is filling data; others wait */
+  int                error; /*!< negated errno of the last failed fill */
+  uint64_t           atime; /*!< far_tick of last use */
+  far_arc_t          list;  /*!< list the block is on */
+  struct far_block_t *prev; /*!< more recently used block on the list */
+  struct far_block_t *next; /*!< less recently used block on the list */
+  struct far_block_t *hnext; /*!< next block in the hash chain */
+} far_block_t;
+
+/*! Block cache list, most recently used first */
+typedef struct far_list_t
+{
+  far_block_t *head;  /*!< most recently used block */
+  far_block_t *tail;  /*!< least recently used block */
+  size_t      count;  /*!< number of blocks */
+} far_list_t;
+
+/*! Block cache with ARC eviction */
+static struct
+{
+  pthread_mutex_t lock;      /*!< protects everything below */
+  pthread_cond_t  filled;    /*!< signalled whenever a fill finishes */
+  far_block_t     **hash;    /*!< hash chains of resident and ghost blocks */
+  size_t          hash_mask; /*!< number of hash chains minus one */
+  far_list_t      lists[FAR_ARC_MAX]; /*!< ARC lists */
+  size_t          capacity;  /*!< resident blocks to keep (c) */
+  size_t          p;         /*!< target number of T1 blocks */
+} far_cache = { .lock = PTHREAD_MUTEX_INITIALIZER, .filled = PTHREAD_COND_INITIALIZER };
+
+/*! Block cache fill function
+ *
+ *  @param[in]  key  Block key
+ *  @param[out] data Block data, allocated with malloc or posix_memalign
+ *  @param[out] size Valid bytes of data
+ *
+ *  @returns 0 for success
+ *  @returns negated errno otherwise
+ */
+typedef int (*far_fill_t)(uint64_t key, char **data, size_t *size);
+
+/*! Default number of I/O threads */
+#define FAR_IO_THREADS      8
+/*! Most I/O threads */
+#define FAR_MAX_IO_THREADS  256
+/*! FUSE workers kept beyond the I/O threads for everything but cold reads */
+#define FAR_SPARE_WORKERS   10
+
+/*! Default number of I/O threads that may prefetch at once */
+#define FAR_PREFETCH_DEPTH  2
+/*! Most prefetches queued at once; more are dropped */
+#define FAR_PREFETCH_QUEUE  256
+/*! Bytes prefetched before an I/O thread looks for reads again */
+#define FAR_PREFETCH_CHUNK  (1 << 20)
+
+/*! I/O classes, highest priority first */
+typedef enum
+{
+  FAR_IO_READ,     /*!< read an application is waiting for */
+  FAR_IO_PREFETCH, /*!< speculative read nobody waits for */
+  FAR_IO_MAX,      /*!< number of classes */
+} far_io_class_t;
+
+/*! Work for the I/O pool */
+typedef struct far_io_t
+{
+  far_io_class_t  cls;    /*!< I/O class */
+  off_t           offset; /*!< offset (from header) to start at */
+  char            *buffer; /*!< buffer to fill (FAR_IO_READ) */
+  size_t          size;   /*!< number of bytes */
+  ssize_t         rc;     /*!< bytes read or negated errno, once done */
+  int             done;   /*!< set by the I/O thread when rc is valid */
+  size_t          owner;  /*!< slot + 1 of the file whose release cancels a prefetch; 0 for none */
+  int             cancelled; /*!< set to drop the rest of a running prefetch */
+  struct far_io_t *next;  /*!< next work in the queue or running list */
+} far_io_t;
+
+/*! I/O pool for reads that would block, and for prefetching */
+static struct
 {
-  uint32_t   magic;       /*!< magic marker "FAR\0" */
-  uint32_t   version;     /*!< archive version */
-  uint32_t   nentries;    /*!< total number of entries */
-  uint32_t   namesize;    /*!< ??? */
-  uint32_t   rootentries; /*!< number of entries in root directory */
-  FARentry_t rootdir[];   /*!< array of entries for root directory */
-} FARheader_t;
+  pthread_mutex_t lock;     /*!< protects everything below */
+  pthread_cond_t  queued;   /*!< signalled when work may be taken */
+  pthread_cond_t  done;     /*!< signalled when a read is done */
+  pthread_cond_t  room;     /*!< signalled when the prefetch queue shrinks */
+  far_io_t        *head[FAR_IO_MAX];  /*!< oldest queued work per class */
+  far_io_t        **tail[FAR_IO_MAX]; /*!< where the next work is queued */
+  size_t          queued_count[FAR_IO_MAX]; /*!< queued work per class */
+  unsigned        active[FAR_IO_MAX]; /*!< running work per class */
+  far_io_t        *running; /*!< prefetches being run */
+  pthread_t       *threads; /*!< I/O threads */
+  unsigned        nthreads; /*!< number of running I/O threads */
+  int             stop;     /*!< set to stop the I/O threads */
+} far_io = { .lock = PTHREAD_MUTEX_INITIALIZER, .queued = PTHREAD_COND_INITIALIZER,
+             .done = PTHREAD_COND_INITIALIZER, .room = PTHREAD_COND_INITIALIZER,
+             .tail = { &far_io.head[FAR_IO_READ], &far_io.head[FAR_IO_PREFETCH] } };
+
+/*! Most idle decompression contexts kept */
+#define FAR_ZSTD_IDLE       32
 
-/*! FAR open directory handle */
-typedef struct far_dir_t
+/*! Decompression of FAR_ENTRY_ZSTD files */
+static struct
 {
-  const FARentry_t *parent; /*!< pointer to parent entry */
-  const FARentry_t *entry;  /*!< pointer to entry */
-} far_dir_t;
+  pthread_mutex_t lock;   /*!< protects idle */
+  ZSTD_DDict      *ddict; /*!< archive dictionary, digested once at mount */
+  ZSTD_DCtx       *idle[FAR_ZSTD_IDLE]; /*!< contexts ready for reuse */
+  size_t          nidle;  /*!< number of idle contexts */
+} far_zstd = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/*! Memory budget in bytes, adjustable at runtime; 0 for no limit */
+static uint64_t  far_mem_limit = 0;
+/*! Share of far_mem_limit in force, out of FAR_MEM_SCALE; cut under pressure */
+static unsigned  far_mem_scale;
+/*! Use counter ordering cache accesses across all pools */
+static uint64_t  far_tick = 0;
+/*! PSI memory pressure trigger, or -1 */
+static int       far_psi_fd = -1;
+/*! Memory governor thread */
+static pthread_t far_governor_thread;
+/*! Set to stop the memory governor thread */
+static int       far_governor_stop = 0;
+
+/*! Full share of far_mem_limit */
+#define FAR_MEM_SCALE   256
+/*! PSI trigger: 150 ms of memory stalls within a 2 s window */
+#define FAR_PSI_TRIGGER "some 150000 2000000"
+/*! Quiet seconds before the budget recovers after pressure */
+#define FAR_PSI_RECOVER 10
+
+/*! Namespace of FARFS extended attributes */
+#define FAR_XATTR_PREFIX "user.farfs."
+/*! Longest extended attribute value (user.farfs.stats) */
+#define FAR_XATTR_MAX    1024
+
+/*! Largest request we negotiate with the kernel (1 MiB) */
+#define FAR_MAX_REQUEST (1 << 20)
 
 /*! FAR header */
 static FARheader_t *header = NULL;
 
-/*! A dummy root entry */
+/*! FAR entry table */
+static const FARentry_t *far_entries = NULL;
+
+/*! FAR header flags (FAR_HEADER_*) */
+static uint32_t far_flags = 0;
+
+/*! FAR name hash section, if present */
+static const uint32_t *far_namehash = NULL;
+
+/*! FAR perfect hash section, if present */
+static const FARphash_t *far_phash = NULL;
+
+/*! FAR chunk section, if present */
+static const FARchunk_t *far_chunks = NULL;
+/*! Number of chunks in far_chunks */
+static size_t           far_nchunks = 0;
+
+/*! FAR dictionary section, if present */
+static const void *far_dict = NULL;
+/*! Size of far_dict */
+static size_t     far_dictsize = 0;
+
+/*! FAR solid block section, if present */
+static const FARblock_t *far_blocks = NULL;
+/*! Number of blocks in far_blocks */
+static size_t           far_nblocks = 0;
+
+/*! A dummy root entry; dataoff is set to the entry table at mount */
 static FARentry_t dummy_root =
 {
   .flags   = FAR_DIR_TYPE,
   .nameoff = 0,
-  .dataoff = offsetof(FARheader_t, rootdir),
+  .dataoff = sizeof(FARheader_t),
   .size    = 0,
 };
 
 /*! pointer to dummy_root */
 static FARentry_t *root = &dummy_root;
 
+/*! Bump a request counter
+ *
+ *  @param[in] stat  Counter to bump
+ *  @param[in] count Amount to add
+ */
+static inline void
+far_stat_add(far_stat_t stat,
+             uint64_t   count)
+{
+  if(far_options.stats)
+    __atomic_fetch_add(&far_stats[stat], count, __ATOMIC_RELAXED);
+}
+
+/*! Bloom filter bits per directory child */
+#define FAR_BLOOM_BITS   10
+/*! Bloom filter probes per name (~1% false positives at 10 bits) */
+#define FAR_BLOOM_PROBES 7
+/*! Directories with fewer children are scanned without a filter */
+#define FAR_BLOOM_MIN    8
+/*! Bloom filter index for a directory without a filter */
+#define FAR_BLOOM_NONE   UINT32_MAX
+
+/*! Bloom filter words for all directories */
+static uint64_t *far_bloom = NULL;
+/*! Size of far_bloom in bytes */
+static size_t   far_bloom_size = 0;
+/*! Offset into far_bloom for each slot, or FAR_BLOOM_NONE */
+static uint32_t *far_bloom_index = NULL;
+/*! Size of far_bloom_index in bytes */
+static size_t   far_bloom_index_size = 0;
+/*! Words per far_parallel chunk while building the filters */
+static size_t   *far_bloom_chunks = NULL;
+
+/*! Case-insensitive lookup bucket */
+typedef struct far_icase_t
+{
+  uint32_t slot;   /*!< slot of entry; 0 marks an empty bucket */
+  uint32_t parent; /*!< slot of parent */
+  uint32_t tag;    /*!< upper bits of the key hash */
+} far_icase_t;
+
+/*! Case-insensitive lookup table */
+static far_icase_t *far_icase = NULL;
+/*! Size of far_icase in bytes */
+static size_t      far_icase_size = 0;
+/*! Case-insensitive lookup table size minus one */
+static size_t      far_icase_mask = 0;
+
+/*! Inode table entry */
+typedef struct far_inode_t
+{
+  uint32_t parent; /*!< slot of parent; UINT32_MAX if unreachable */
+  uint32_t nlink;  /*!< link count */
+  uint32_t ino;    /*!< first slot whose file data this one shares, or its own */
+} far_inode_t;
+
+/*! Inode table, indexed by slot */
+static far_inode_t *far_inodes = NULL;
+/*! Size of far_inodes in bytes */
+static size_t      far_inodes_size = 0;
+
+/*! Recursive totals of a directory */
+typedef struct far_total_t
+{
+  uint64_t size;  /*!< bytes in files below the directory */
+  uint32_t slot;  /*!< slot of directory */
+  uint32_t files; /*!< files below the directory */
+  uint32_t dirs;  /*!< directories below the directory */
+} far_total_t;
+
+/*! Recursive totals of every directory, by slot */
+static far_total_t *far_totals = NULL;
+/*! Size of far_totals in bytes */
+static size_t      far_totals_size = 0;
+
+/*! Files by data extent, while the inode table is built; 0 is empty */
+static uint32_t    *far_links = NULL;
+/*! far_links size minus one */
+static size_t      far_links_mask = 0;
+
+/*! Mount-time index segment */
+typedef struct far_segment_t
+{
+  void   **data; /*!< segment data */
+  size_t *size;  /*!< segment size in bytes */
+} far_segment_t;
+
+/*! Mount-time index segments, in sidecar order */
+static const far_segment_t far_segments[] =
+{
+  { (void**)&far_bloom,       &far_bloom_size,       },
+  { (void**)&far_bloom_index, &far_bloom_index_size, },
+  { (void**)&far_icase,       &far_icase_size,       },
+  { (void**)&far_inodes,      &far_inodes_size,      },
+  { (void**)&far_totals,      &far_totals_size,      },
+};
+
+/*! Number of mount-time index segments */
+#define FAR_NUM_SEGMENTS (sizeof(far_segments) / sizeof(far_segments[0]))
+
+/*! Sidecar index cache magic */
+#define FAR_SIDECAR_MAGIC   MAGIC('F', 'A', 'R', 'I')
+/*! Sidecar index cache version; bump whenever the segments or the key
+ *  change
+ */
+#define FAR_SIDECAR_VERSION 5
+/*! Sidecar segment alignment */
+#define FAR_SIDECAR_ALIGN   64
+/*! Bytes of metadata hashed as one piece of the sidecar checksum */
+#define FAR_SIDECAR_SUMSIZE 4096
+
+/*! Sidecar index cache header
+ *
+ *  The sidecar is a host-local cache, so it is written in native byte
+ *  order; a foreign one simply fails to match.
+ */
+typedef struct far_sidecar_t
+{
+  uint32_t magic;      /*!< FAR_SIDECAR_MAGIC */
+  uint32_t version;    /*!< FAR_SIDECAR_VERSION */
+  uint32_t options;    /*!< mount options the index depends on */
+  uint32_t nsegments;  /*!< FAR_NUM_SEGMENTS */
+  uint64_t size;       /*!< archive size */
+  int64_t  mtime_sec;  /*!< archive modification time (seconds) */
+  int64_t  mtime_nsec; /*!< archive modification time (nanoseconds) */
+  uint64_t checksum;   /*!< hash of the archive's metadata */
+  struct
+  {
+    uint64_t offset;   /*!< offset of segment in sidecar */
+    uint64_t size;     /*!< size of segment in bytes */
+  } segments[FAR_NUM_SEGMENTS];
+} far_sidecar_t;
+
+/*! Sidecar mapping, if the index was loaded from one */
+static void   *far_sidecar = NULL;
+/*! Size of far_sidecar */
+static size_t far_sidecar_size = 0;
+
+/*! Kernel negative lookup timeout when none is given (seconds) */
+#define FAR_NEGATIVE_TIMEOUT 60.0
+
 /*! Get type from an entry
  *
  *  @param[in] entry Entry to get type of
@@ -107,16 +543,75 @@ far_type(const FARentry_t *entry)
   return le32_to_cpu(entry->flags) & 0xFF;
 }
 
+/*! Apply an entry's front-coded name record
+ *
+ *  @param[in]    entry Entry whose record to apply
+ *  @param[inout] buf   Previous entry's name; replaced by this entry's name
+ *
+ *  @returns length of name
+ */
+static inline size_t
+far_name_apply(const FARentry_t *entry,
+               char             *buf)
+{
+  const FARname_t *rec = (const FARname_t*)((const char*)far_mapping
+                                            + le32_to_cpu(entry->nameoff));
+
+  memcpy(buf + rec->prefix, rec->suffix, rec->length);
+  return rec->prefix + rec->length;
+}
+
 /*! Get name for an entry
  *
- *  @param[in] entry Entry to get name of
+ *  @param[in]  entry Entry to get name of
+ *  @param[out] buf   Scratch buffer of FAR_NAME_MAX+1 bytes
+ *  @param[out] len   Length of name
+ *
+ *  @returns name of entry
+ */
+static inline const char*
+far_name(const FARentry_t *entry,
+         char             *buf,
+         size_t           *len)
+{
+  const char *name = (const char*)far_mapping + le32_to_cpu(entry->nameoff);
+  size_t     i, index;
+
+  if(!(far_flags & FAR_HEADER_FRONTCODED))
+  {
+    *len = strlen(name);
+    return name;
+  }
+
+  /* decode forward from the nearest restart */
+  index = entry - far_entries;
+  for(i = index - index % FAR_NAME_RESTART; i <= index; ++i)
+    *len = far_name_apply(far_entries + i, buf);
+
+  buf[*len] = '\0';
+  return buf;
+}
+
+/*! Get name for an entry when iterating over siblings
+ *
+ *  @param[in]    entry Entry to get name of
+ *  @param[inout] buf   Name of the previous sibling, as returned by far_name
+ *                      or far_name_next; replaced by this entry's name
+ *  @param[out]   len   Length of name
  *
  *  @returns name of entry
  */
 static inline const char*
-far_name(const FARentry_t *entry)
+far_name_next(const FARentry_t *entry,
+              char             *buf,
+              size_t           *len)
 {
-  return (const char*)far_mapping + le32_to_cpu(entry->nameoff);
+  if(!(far_flags & FAR_HEADER_FRONTCODED))
+    return far_name(entry, buf, len);
+
+  *len = far_name_apply(entry, buf);
+  buf[*len] = '\0';
+  return buf;
 }
 
 /*! Get data for an entry
@@ -145,405 +640,4580 @@ far_datasize(const FARentry_t *entry)
 
 /*! Get children for a directory entry
  *
- *  @param[in] entry Entry to get children of
+ *  The archive was validated at mount, so this trusts dataoff.
+ *
+ *  @param[in] entry Entry to get children of (must be a directory)
  *
  *  @returns children of entry
  */
 static inline const FARentry_t*
 far_children(const FARentry_t *entry)
 {
-  if(far_type(entry) != FAR_DIR_TYPE)
-    abort();
-
   return (const FARentry_t*)far_data(entry);
 }
 
-/*! Create a new open directory handle
+/*! Find where a file's data continues in the archive
+ *
+ *  A chunked file is stored in pieces; any other file is one extent.
+ *
+ *  @param[in]  entry  File
+ *  @param[in]  offset Offset into the file, less than its size
+ *  @param[out] pos    Offset (from header) to the data at offset
+ *
+ *  @returns number of bytes stored contiguously from pos
+ */
+static size_t
+far_extent(const FARentry_t *entry,
+           size_t           offset,
+           off_t            *pos)
+{
+  const FARchunklist_t *list;
+  const FARchunk_t     *chunk;
+  size_t               lo, hi, mid, start;
+
+  if(!(le32_to_cpu(entry->flags) & FAR_ENTRY_CHUNKED))
+  {
+    *pos = le32_to_cpu(entry->dataoff) + offset;
+    return far_datasize(entry) - offset;
+  }
+
+  /* the first chunk that ends past offset */
+  list = (const FARchunklist_t*)far_data(entry);
+  lo   = 0;
+  hi   = le32_to_cpu(list->count);
+  while(lo < hi)
+  {
+    mid = lo + (hi - lo) / 2;
+    if(le32_to_cpu(list->refs[mid].end) <= offset)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  start = lo ? le32_to_cpu(list->refs[lo-1].end) : 0;
+  chunk = far_chunks + le32_to_cpu(list->refs[lo].chunk);
+  *pos  = le32_to_cpu(chunk->offset) + offset - start;
+
+  return le32_to_cpu(list->refs[lo].end) - offset;
+}
+
+/*! Find the solid block holding part of the solid stream
  *
- *  @param[in] parent Parent of entry
- *  @param[in] entry  Opened entry
+ *  @param[in] pos Offset into the solid stream
  *
- *  @returns open directory handle
+ *  @returns index of block
+ *  @returns far_nblocks if pos is past the end of the stream
  */
-static inline far_dir_t*
-far_dir_new(const FARentry_t *parent,
-            const FARentry_t *entry)
+static size_t
+far_solid_block(size_t pos)
 {
-  far_dir_t *d = (far_dir_t*)malloc(sizeof(far_dir_t));
-  if(d != NULL)
+  size_t lo = 0, hi = far_nblocks, mid;
+
+  while(lo < hi)
   {
-    d->parent = parent;
-    d->entry  = entry;
+    mid = lo + (hi - lo) / 2;
+    if(le32_to_cpu(far_blocks[mid].end) <= pos)
+      lo = mid + 1;
+    else
+      hi = mid;
   }
 
-  return d;
+  return lo;
 }
-            
-/*! Fill a stat struct from an entry
+
+/*! Get where a solid block starts in the solid stream
  *
- *  @param[in]  entry Entry to use
- *  @param[out] st    Buffer to fill
+ *  @param[in] block Index of block
+ *
+ *  @returns offset into the solid stream
  */
-static void
-far_fill_stat(const FARentry_t *entry,
-              struct stat      *st)
+static inline size_t
+far_solid_start(size_t block)
+{
+  return block ? le32_to_cpu(far_blocks[block-1].end) : 0;
+}
+
+/*! Find where a file is stored in the archive
+ *
+ *  A compressed record is never larger than its file, so the file's size
+ *  covers it. A solid file takes its whole block with it. Chunked files
+ *  are stored in pieces; see far_extent.
+ *
+ *  @param[in]  entry File (not chunked)
+ *  @param[out] pos   Offset (from header) to the stored data
+ *
+ *  @returns number of bytes stored from pos
+ */
+static size_t
+far_stored(const FARentry_t *entry,
+           off_t            *pos)
 {
-  st->st_dev = 0;
+  const FARblock_t *block;
+
+  if(!(le32_to_cpu(entry->flags) & FAR_ENTRY_SOLID))
+  {
+    *pos = le32_to_cpu(entry->dataoff);
+    return far_datasize(entry);
+  }
+
+  block = far_blocks + far_solid_block(le32_to_cpu(entry->dataoff));
+  *pos  = le32_to_cpu(block->offset);
+  return le32_to_cpu(block->size);
+}
 
+/*! Get the index slot of an entry
+ *
+ *  Slot 0 is the root directory and slot i+1 is the i-th entry of the
+ *  entry table, so slots are inode numbers minus one.
+ *
+ *  @param[in] entry Entry to get slot of
+ *
+ *  @returns slot of entry
+ */
+static inline size_t
+far_slot(const FARentry_t *entry)
+{
   if(entry == root)
-    st->st_ino = 1;
-  else
-    st->st_ino = (entry - header->rootdir) + 2;
+    return 0;
 
-  if(far_type(entry) == FAR_DIR_TYPE)
+  return (entry - far_entries) + 1;
+}
+
+/*! Get the entry in an index slot
+ *
+ *  @param[in] slot Slot to get entry of
+ *
+ *  @returns entry in slot
+ */
+static inline const FARentry_t*
+far_slot_entry(size_t slot)
+{
+  if(slot == 0)
+    return root;
+
+  return far_entries + (slot - 1);
+}
+
+/*! Get the parent of a reachable entry
+ *
+ *  @param[in] entry Entry to get parent of
+ *
+ *  @returns parent of entry; the root directory is its own parent
+ */
+static inline const FARentry_t*
+far_parent(const FARentry_t *entry)
+{
+  return far_slot_entry(far_inodes[far_slot(entry)].parent);
+}
+
+/*! Mount-time work function
+ *
+ *  @param[in] begin First item to process
+ *  @param[in] end   One past the last item to process
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+typedef int (*far_work_t)(size_t begin, size_t end);
+
+/*! Mount-time parallel job */
+typedef struct far_job_t
+{
+  far_work_t work;   /*!< work function */
+  size_t     nitems; /*!< number of items */
+  size_t     next;   /*!< next item to hand out */
+  int        rc;     /*!< 0, or -1 once any chunk failed */
+} far_job_t;
+
+/*! Mount-time parallel worker
+ *
+ *  @param[in] arg Job to work on
+ *
+ *  @returns NULL
+ */
+static void*
+far_job_worker(void *arg)
+{
+  far_job_t *job = (far_job_t*)arg;
+  size_t    begin, end;
+
+  while(!__atomic_load_n(&job->rc, __ATOMIC_RELAXED))
   {
-    uint32_t         i;
-    uint32_t         num_children = far_datasize(entry);
-    const FARentry_t *children    = far_children(entry);
+    begin = __atomic_fetch_add(&job->next, FAR_JOB_CHUNK, __ATOMIC_RELAXED);
+    if(begin >= job->nitems)
+      break;
 
-    for(i = 0, st->st_nlink = 2; i < num_children; ++i)
-    {
-      if(far_type(children+i) == FAR_DIR_TYPE)
-        st->st_nlink += 1;
-    }
+    end = job->nitems - begin < FAR_JOB_CHUNK ? job->nitems : begin + FAR_JOB_CHUNK;
+    if(job->work(begin, end) != 0)
+      __atomic_store_n(&job->rc, -1, __ATOMIC_RELAXED);
   }
-  else
-    st->st_nlink   = 1;
 
-  st->st_uid     = getuid();
-  st->st_gid     = getgid();
-  st->st_rdev    = 0;
-  if(far_type(entry) == FAR_DIR_TYPE)
-    st->st_size = far_datasize(entry) * sizeof(FARentry_t);
-  else
-    st->st_size = far_datasize(entry);
+  return NULL;
+}
 
-  st->st_blksize = 4096;
-  st->st_blocks  = (st->st_size + st->st_blksize-1) / 512;
-  st->st_atime   = far_atime;
-  st->st_mtime   = far_mtime;
-  st->st_ctime   = far_ctime;
+/*! Run a work function over items in parallel
+ *
+ *  Items are handed out in chunks of FAR_JOB_CHUNK, each starting at a
+ *  multiple of FAR_JOB_CHUNK.
+ *
+ *  @param[in] work   Work function
+ *  @param[in] nitems Number of items
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+far_parallel(far_work_t work,
+             size_t     nitems)
+{
+  far_job_t job = { work, nitems, 0, 0 };
+  pthread_t threads[FAR_MAX_MOUNT_THREADS];
+  size_t    i, nthreads = far_options.mount_threads;
+
+  /* no point in starting more threads than there are chunks */
+  if(nthreads > (nitems + FAR_JOB_CHUNK - 1) / FAR_JOB_CHUNK)
+    nthreads = (nitems + FAR_JOB_CHUNK - 1) / FAR_JOB_CHUNK;
+
+  /* the calling thread is one of the workers */
+  for(i = 1; i < nthreads; ++i)
+  {
+    if(pthread_create(&threads[i], NULL, far_job_worker, &job) != 0)
+      break;
+  }
+  nthreads = i;
+
+  far_job_worker(&job);
+  for(i = 1; i < nthreads; ++i)
+    pthread_join(threads[i], NULL);
+
+  return job.rc;
+}
+
+/*! Get the number of bloom filter words for a directory
+ *
+ *  @param[in] num_children Number of children in directory
+ *
+ *  @returns number of 64-bit words, or 0 for no filter
+ */
+static inline size_t
+far_bloom_words(size_t num_children)
+{
+  size_t bits = 64;
+
+  if(num_children < FAR_BLOOM_MIN)
+    return 0;
+
+  /* round up to a power of two so probes can be masked */
+  while(bits < num_children * FAR_BLOOM_BITS)
+    bits <<= 1;
+
+  return bits / 64;
+}
+
+/*! Test whether a name may be in a directory
+ *
+ *  @param[in] dir  Directory to test
+ *  @param[in] hash Hash of name
+ *
+ *  @returns whether name may be a child of dir
+ */
+static inline int
+far_bloom_test(const FARentry_t *dir,
+               uint64_t         hash)
+{
+  size_t         i, mask;
+  uint32_t       h1 = hash, h2 = (hash >> 32) | 1;
+  const uint64_t *words;
+
+  if(far_bloom_index == NULL || far_bloom_index[far_slot(dir)] == FAR_BLOOM_NONE)
+    return 1;
+
+  words = far_bloom + far_bloom_index[far_slot(dir)];
+  mask  = far_bloom_words(far_datasize(dir)) * 64 - 1;
+
+  for(i = 0; i < FAR_BLOOM_PROBES; ++i, h1 += h2)
+  {
+    if(!(words[(h1 & mask) / 64] & (UINT64_C(1) << (h1 % 64))))
+      return 0;
+  }
+
+  return 1;
+}
+
+/*! Size the bloom filters for a range of slots
+ *
+ *  Leaves the number of words in far_bloom_index and the chunk's total in
+ *  far_bloom_chunks.
+ *
+ *  @param[in] begin First slot
+ *  @param[in] end   One past the last slot
+ *
+ *  @returns 0
+ */
+static int
+far_bloom_size_work(size_t begin,
+                    size_t end)
+{
+  size_t           slot, nwords = 0;
+  const FARentry_t *dir;
+
+  for(slot = begin; slot < end; ++slot)
+  {
+    dir = far_slot_entry(slot);
+    far_bloom_index[slot] = 0;
+    if(far_type(dir) == FAR_DIR_TYPE)
+      far_bloom_index[slot] = far_bloom_words(far_datasize(dir));
+    nwords += far_bloom_index[slot];
+  }
+
+  far_bloom_chunks[begin / FAR_JOB_CHUNK] = nwords;
+  return 0;
+}
+
+/*! Fill the bloom filters for a range of slots
+ *
+ *  @param[in] begin First slot
+ *  @param[in] end   One past the last slot
+ *
+ *  @returns 0
+ */
+static int
+far_bloom_fill_work(size_t begin,
+                    size_t end)
+{
+  size_t           slot, i, j, mask, num_children, len;
+  size_t           nwords = far_bloom_chunks[begin / FAR_JOB_CHUNK];
+  uint64_t         hash, *words;
+  uint32_t         h1, h2;
+  const FARentry_t *dir, *children;
+  const char       *name;
+  char             buf[FAR_NAME_MAX+1];
+
+  for(slot = begin; slot < end; ++slot)
+  {
+    /* turn the word count into an offset */
+    if(far_bloom_index[slot] == 0)
+    {
+      far_bloom_index[slot] = FAR_BLOOM_NONE;
+      continue;
+    }
+
+    words   = far_bloom + nwords;
+    nwords += far_bloom_index[slot];
+    far_bloom_index[slot] = words - far_bloom;
+
+    /* hash every child name into the filter */
+    dir          = far_slot_entry(slot);
+    num_children = far_datasize(dir);
+    children     = far_children(dir);
+    mask         = far_bloom_words(num_children) * 64 - 1;
+
+    for(i = 0; i < num_children; ++i)
+    {
+      if(i == 0)
+        name = far_name(children+i, buf, &len);
+      else
+        name = far_name_next(children+i, buf, &len);
+
+      hash = far_hash(name, len);
+      h1   = hash;
+      h2   = (hash >> 32) | 1;
+      for(j = 0; j < FAR_BLOOM_PROBES; ++j, h1 += h2)
+        words[(h1 & mask) / 64] |= UINT64_C(1) << (h1 % 64);
+    }
+  }
+
+  return 0;
+}
+
+/*! Build the bloom filters for every directory
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+far_bloom_build(void)
+{
+  size_t nslots  = le32_to_cpu(header->nentries) + 1;
+  size_t nchunks = (nslots + FAR_JOB_CHUNK - 1) / FAR_JOB_CHUNK;
+  size_t i, nwords, total;
+  int    rc = -1;
+
+  far_bloom_index_size = nslots * sizeof(uint32_t);
+  far_bloom_index      = (uint32_t*)malloc(far_bloom_index_size);
+  far_bloom_chunks     = (size_t*)malloc(nchunks * sizeof(size_t));
+  if(far_bloom_index == NULL || far_bloom_chunks == NULL)
+    goto out;
+
+  /* size every filter, then lay them out back to back */
+  far_parallel(far_bloom_size_work, nslots);
+  for(i = 0, total = 0; i < nchunks; ++i)
+  {
+    nwords              = far_bloom_chunks[i];
+    far_bloom_chunks[i] = total;
+    total              += nwords;
+  }
+
+  if(total >= FAR_BLOOM_NONE)
+    goto out;
+
+  far_bloom_size = total * sizeof(uint64_t);
+  far_bloom      = (uint64_t*)calloc(total, sizeof(uint64_t));
+  if(far_bloom == NULL && total != 0)
+    goto out;
+
+  rc = far_parallel(far_bloom_fill_work, nslots);
+
+out:
+  free(far_bloom_chunks);
+  far_bloom_chunks = NULL;
+  return rc;
+}
+
+/*! Hash a case-folded name for the case-insensitive lookup table
+ *
+ *  Only ASCII letters are folded.
+ *
+ *  @param[in] parent Slot of parent directory
+ *  @param[in] name   Name to hash (not necessarily NUL-terminated)
+ *  @param[in] len    Length of name
+ *
+ *  @returns hash of parent and folded name
+ */
+static inline uint64_t
+far_icase_key(size_t     parent,
+              const char *name,
+              size_t     len)
+{
+  uint64_t      hash = UINT64_C(0xcbf29ce484222325);
+  unsigned char c;
+
+  while(len-- > 0)
+  {
+    c = *name++;
+    if(c >= 'A' && c <= 'Z')
+      c += 'a' - 'A';
+
+    hash ^= c;
+    hash *= UINT64_C(0x100000001b3);
+  }
+
+  return far_mix64(hash ^ parent);
+}
+
+/*! Insert a range of directories into the case-insensitive lookup table
+ *
+ *  @param[in] begin First slot
+ *  @param[in] end   One past the last slot
+ *
+ *  @returns 0
+ */
+static int
+far_icase_work(size_t begin,
+               size_t end)
+{
+  size_t           slot, i, b, len, num_children;
+  uint64_t         key;
+  uint32_t         empty;
+  const FARentry_t *dir, *children;
+  const char       *name;
+  char             buf[FAR_NAME_MAX+1];
+
+  for(slot = begin; slot < end; ++slot)
+  {
+    dir = far_slot_entry(slot);
+    if(far_type(dir) != FAR_DIR_TYPE)
+      continue;
+
+    num_children = far_datasize(dir);
+    children     = far_children(dir);
+    for(i = 0; i < num_children; ++i)
+    {
+      if(i == 0)
+        name = far_name(children+i, buf, &len);
+      else
+        name = far_name_next(children+i, buf, &len);
+
+      /* linear probing for a free bucket; claim it atomically since other
+       * threads are inserting too
+       */
+      key = far_icase_key(slot, name, len);
+      for(b = key & far_icase_mask; ; b = (b + 1) & far_icase_mask)
+      {
+        empty = 0;
+        if(__atomic_compare_exchange_n(&far_icase[b].slot, &empty, far_slot(children+i),
+                                       0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+          break;
+      }
+
+      far_icase[b].parent = slot;
+      far_icase[b].tag    = key >> 32;
+    }
+  }
+
+  return 0;
+}
+
+/*! Build the case-insensitive lookup table
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+far_icase_build(void)
+{
+  size_t nslots = le32_to_cpu(header->nentries) + 1, size = 16;
+
+  /* keep the load factor under 3/4 */
+  while(size * 3 < nslots * 4)
+    size <<= 1;
+
+  far_icase_size = size * sizeof(far_icase_t);
+  far_icase      = (far_icase_t*)calloc(size, sizeof(far_icase_t));
+  if(far_icase == NULL)
+    return -1;
+  far_icase_mask = size - 1;
+
+  return far_parallel(far_icase_work, nslots);
+}
+
+/*! Compare a slot to a directory's totals for bsearch
+ *
+ *  @param[in] key   Slot
+ *  @param[in] total Totals
+ *
+ *  @returns <0 if the slot comes first
+ *  @returns 0 if the totals are the slot's
+ *  @returns >0 if the slot comes after
+ */
+static int
+far_total_cmp(const void *key,
+              const void *total)
+{
+  uint32_t slot = *(const uint32_t*)key;
+
+  if(slot < ((const far_total_t*)total)->slot)
+    return -1;
+  return slot > ((const far_total_t*)total)->slot;
+}
+
+/*! Get the recursive totals of a directory
+ *
+ *  @param[in] dir Directory
+ *
+ *  @returns totals
+ */
+static const far_total_t*
+far_total(const FARentry_t *dir)
+{
+  uint32_t slot = far_slot(dir);
+
+  return (const far_total_t*)bsearch(&slot, far_totals,
+                                     far_totals_size / sizeof(far_total_t),
+                                     sizeof(far_total_t), far_total_cmp);
+}
+
+/*! Sum up the recursive totals of every directory
+ *
+ *  Children always come after their directory in the entry table, so going
+ *  backwards finishes every subdirectory before its parent.
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+far_totals_build(void)
+{
+  size_t            nslots = le32_to_cpu(header->nentries) + 1;
+  size_t            slot, i, n;
+  far_total_t       *total;
+  const far_total_t *sub;
+  const FARentry_t  *dir, *child;
+
+  for(slot = 0, n = 0; slot < nslots; ++slot)
+  {
+    if(far_type(far_slot_entry(slot)) == FAR_DIR_TYPE)
+      ++n;
+  }
+
+  far_totals_size = n * sizeof(far_total_t);
+  far_totals      = (far_total_t*)calloc(n, sizeof(far_total_t));
+  if(far_totals == NULL)
+    return -1;
+
+  for(slot = 0, n = 0; slot < nslots; ++slot)
+  {
+    if(far_type(far_slot_entry(slot)) == FAR_DIR_TYPE)
+      far_totals[n++].slot = slot;
+  }
+
+  while(n-- > 0)
+  {
+    total = far_totals + n;
+    dir   = far_slot_entry(total->slot);
+    child = far_children(dir);
+    for(i = 0; i < far_datasize(dir); ++i, ++child)
+    {
+      if(far_type(child) != FAR_DIR_TYPE)
+      {
+        total->size  += far_datasize(child);
+        total->files += 1;
+        continue;
+      }
+
+      sub = far_total(child);
+      total->size  += sub->size;
+      total->files += sub->files;
+      total->dirs  += sub->dirs + 1;
+    }
+  }
+
+  return 0;
+}
+
+/*! Free the mount-time index */
+static void
+far_index_free(void)
+{
+  size_t i;
+
+  for(i = 0; i < FAR_NUM_SEGMENTS; ++i)
+  {
+    if(far_sidecar == NULL)
+      free(*far_segments[i].data);
+    *far_segments[i].data = NULL;
+    *far_segments[i].size = 0;
+  }
+
+  if(far_sidecar != NULL)
+    munmap(far_sidecar, far_sidecar_size);
+  far_sidecar = NULL;
+}
+
+/*! Build the mount-time index
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+far_index_build(void)
+{
+  int rc = 0;
+
+  /* a perfect hash makes the exact-match filters unnecessary */
+  if(far_options.icase)
+    rc = far_icase_build();
+  else if(far_phash == NULL)
+    rc = far_bloom_build();
+
+  if(rc == 0)
+    rc = far_totals_build();
+
+  return rc;
+}
+
+/*! Find where the file data starts
+ *
+ *  mkfar and farlayout write all of the metadata before the first file's
+ *  data, so everything up to here is what validation looks at.
+ *
+ *  @param[in] size Size of the archive
+ *
+ *  @returns offset (from header) to the first file data
+ */
+static size_t
+far_datastart(size_t size)
+{
+  size_t           i, start = size, nentries = le32_to_cpu(header->nentries);
+  const FARentry_t *entry;
+
+  for(i = 0; i < nentries; ++i)
+  {
+    entry = far_entries + i;
+    if(far_type(entry) == FAR_FILE_TYPE && far_datasize(entry) != 0
+    && !(le32_to_cpu(entry->flags) & (FAR_ENTRY_CHUNKED|FAR_ENTRY_SOLID|FAR_ENTRY_INLINE))
+    && le32_to_cpu(entry->dataoff) < start)
+      start = le32_to_cpu(entry->dataoff);
+  }
+
+  for(i = 0; i < far_nchunks; ++i)
+  {
+    if(le32_to_cpu(far_chunks[i].offset) < start)
+      start = le32_to_cpu(far_chunks[i].offset);
+  }
+
+  for(i = 0; i < far_nblocks; ++i)
+  {
+    if(le32_to_cpu(far_blocks[i].offset) < start)
+      start = le32_to_cpu(far_blocks[i].offset);
+  }
+
+  return start;
+}
+
+/*! Hash of each piece of the metadata, while the sidecar key is made */
+static uint64_t *far_sidecar_sums = NULL;
+/*! Size of the metadata covered by far_sidecar_sums */
+static size_t   far_sidecar_metasize = 0;
+
+/*! Hash a range of metadata pieces
+ *
+ *  @param[in] begin First piece
+ *  @param[in] end   One past the last piece
+ *
+ *  @returns 0
+ */
+static int
+far_sidecar_sum_work(size_t begin,
+                     size_t end)
+{
+  size_t i, offset, len;
+
+  for(i = begin; i < end; ++i)
+  {
+    offset = i * FAR_SIDECAR_SUMSIZE;
+    len    = far_sidecar_metasize - offset < FAR_SIDECAR_SUMSIZE
+           ? far_sidecar_metasize - offset : FAR_SIDECAR_SUMSIZE;
+    far_sidecar_sums[i] = far_hash((const char*)far_mapping + offset, len);
+  }
+
+  return 0;
+}
+
+/*! Fill in the sidecar key for the mounted archive
+ *
+ *  The checksum covers all of the metadata, so that a different archive
+ *  of the same size and modification time never skips validation.
+ *
+ *  @param[in]  st  Stat of the archive
+ *  @param[out] key Sidecar header to fill
+ */
+static void
+far_sidecar_key(const struct stat *st,
+                far_sidecar_t     *key)
+{
+  size_t n;
+
+  memset(key, 0, sizeof(*key));
+  key->magic      = FAR_SIDECAR_MAGIC;
+  key->version    = FAR_SIDECAR_VERSION;
+  key->options    = far_options.icase;
+  key->nsegments  = FAR_NUM_SEGMENTS;
+  key->size       = st->st_size;
+  key->mtime_sec  = st->st_mtim.tv_sec;
+  key->mtime_nsec = st->st_mtim.tv_nsec;
+
+  /* hash the pieces in parallel, then the hashes */
+  far_sidecar_metasize = far_datastart(st->st_size);
+  n                    = (far_sidecar_metasize + FAR_SIDECAR_SUMSIZE - 1) / FAR_SIDECAR_SUMSIZE;
+  far_sidecar_sums     = (uint64_t*)malloc(n * sizeof(uint64_t) + 1);
+  if(far_sidecar_sums == NULL)
+    key->checksum = far_hash((const char*)far_mapping, far_sidecar_metasize);
+  else
+  {
+    far_parallel(far_sidecar_sum_work, n);
+    key->checksum = far_hash((const char*)far_sidecar_sums, n * sizeof(uint64_t));
+  }
+
+  free(far_sidecar_sums);
+  far_sidecar_sums = NULL;
+}
+
+/*! Map the index from a sidecar
+ *
+ *  @param[in] path Sidecar path
+ *  @param[in] key  Expected sidecar key
+ *
+ *  @returns 0 for success
+ *  @returns -1 if the sidecar is missing or stale
+ */
+static int
+far_sidecar_load(const char          *path,
+                 const far_sidecar_t *key)
+{
+  const far_sidecar_t *sidecar;
+  struct stat         st;
+  size_t              i, nslots, ntables;
+  int                 fd;
+  void                *map;
+
+  fd = open(path, O_RDONLY);
+  if(fd < 0)
+    return -1;
+
+  if(fstat(fd, &st) != 0 || st.st_size < sizeof(far_sidecar_t))
+  {
+    close(fd);
+    return -1;
+  }
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED)
+    return -1;
+
+  /* everything up to the segment table must match */
+  sidecar = (const far_sidecar_t*)map;
+  if(memcmp(sidecar, key, offsetof(far_sidecar_t, segments)) != 0)
+  {
+    munmap(map, st.st_size);
+    return -1;
+  }
+
+  for(i = 0; i < FAR_NUM_SEGMENTS; ++i)
+  {
+    if(sidecar->segments[i].offset % FAR_SIDECAR_ALIGN != 0
+    || sidecar->segments[i].offset > st.st_size
+    || st.st_size - sidecar->segments[i].offset < sidecar->segments[i].size)
+    {
+      munmap(map, st.st_size);
+      return -1;
+    }
+  }
+
+  far_sidecar      = map;
+  far_sidecar_size = st.st_size;
+  for(i = 0; i < FAR_NUM_SEGMENTS; ++i)
+  {
+    *far_segments[i].size = sidecar->segments[i].size;
+    *far_segments[i].data = NULL;
+    if(sidecar->segments[i].size != 0)
+      *far_segments[i].data = (char*)map + sidecar->segments[i].offset;
+  }
+
+  /* every segment must be the size the index builders would have made */
+  nslots = le32_to_cpu(header->nentries) + 1;
+  ntables = far_icase_size / sizeof(far_icase_t);
+  if(far_inodes_size != nslots * sizeof(far_inode_t)
+  || far_totals_size == 0 || far_totals_size % sizeof(far_total_t) != 0
+  || far_totals_size / sizeof(far_total_t) > nslots
+  || (far_options.icase
+      ? ntables < nslots || (ntables & (ntables - 1)) != 0
+        || far_icase_size % sizeof(far_icase_t) != 0
+      : far_icase_size != 0)
+  || (far_bloom_index != NULL
+      && far_bloom_index_size != nslots * sizeof(uint32_t))
+  || far_bloom_size % sizeof(uint64_t) != 0)
+  {
+    far_index_free();
+    return -1;
+  }
+
+  /* recover the values derived from segment sizes */
+  if(far_icase != NULL)
+    far_icase_mask = ntables - 1;
+
+  return 0;
+}
+
+/*! Write the index to a sidecar
+ *
+ *  The sidecar is written to a temporary file and renamed into place, so
+ *  concurrent mounts never see a partial one.
+ *
+ *  @param[in] path Sidecar path
+ *  @param[in] key  Sidecar key
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+far_sidecar_save(const char          *path,
+                 const far_sidecar_t *key)
+{
+  far_sidecar_t sidecar = *key;
+  static const char zero[FAR_SIDECAR_ALIGN];
+  char          *tmp;
+  size_t        i, offset = sizeof(sidecar);
+  FILE          *fp;
+  int           rc = 0;
+
+  tmp = (char*)malloc(strlen(path) + 32);
+  if(tmp == NULL)
+    return -1;
+  sprintf(tmp, "%s.%ld.tmp", path, (long)getpid());
+
+  fp = fopen(tmp, "wb");
+  if(fp == NULL)
+  {
+    free(tmp);
+    return -1;
+  }
+
+  for(i = 0; i < FAR_NUM_SEGMENTS; ++i)
+  {
+    offset += -offset & (FAR_SIDECAR_ALIGN - 1);
+    sidecar.segments[i].offset = offset;
+    sidecar.segments[i].size   = *far_segments[i].size;
+    offset += *far_segments[i].size;
+  }
+
+  if(fwrite(&sidecar, sizeof(sidecar), 1, fp) != 1)
+    rc = -1;
+
+  for(i = 0, offset = sizeof(sidecar); rc == 0 && i < FAR_NUM_SEGMENTS; ++i)
+  {
+    if(fwrite(zero, 1, sidecar.segments[i].offset - offset, fp)
+       != sidecar.segments[i].offset - offset
+    || (sidecar.segments[i].size != 0
+        && fwrite(*far_segments[i].data, 1, sidecar.segments[i].size, fp)
+           != sidecar.segments[i].size))
+      rc = -1;
+
+    offset = sidecar.segments[i].offset + sidecar.segments[i].size;
+  }
+
+  if(fclose(fp) != 0)
+    rc = -1;
+  if(rc == 0 && rename(tmp, path) != 0)
+    rc = -1;
+  if(rc != 0)
+    unlink(tmp);
+
+  free(tmp);
+  return rc;
+}
+
+/*! Fill a stat struct from an entry
+ *
+ *  @param[in]  entry Entry to use
+ *  @param[out] st    Buffer to fill
+ */
+static void
+far_fill_stat(const FARentry_t *entry,
+              struct stat      *st)
+{
+  size_t slot = far_slot(entry);
+
+  st->st_dev     = 0;
+  st->st_ino     = far_inodes[slot].ino + 1;
+  st->st_nlink   = far_inodes[far_inodes[slot].ino].nlink;
+  st->st_uid     = getuid();
+  st->st_gid     = getgid();
+  st->st_rdev    = 0;
+  if(far_type(entry) == FAR_DIR_TYPE)
+    st->st_size = far_datasize(entry) * sizeof(FARentry_t);
+  else
+    st->st_size = far_datasize(entry);
+
+  st->st_blksize = 4096;
+  st->st_blocks  = (st->st_size + st->st_blksize-1) / 512;
+  st->st_atime   = far_atime;
+  st->st_mtime   = far_mtime;
+  st->st_ctime   = far_ctime;
+
+  if(far_type(entry) == FAR_DIR_TYPE)
+    st->st_mode = FAR_DIR_MODE;
+  else
+    st->st_mode = FAR_FILE_MODE;
+}
+
+/*! Compare two names bytewise
+ *
+ *  @param[in] a    First name
+ *  @param[in] alen Length of first name
+ *  @param[in] b    Second name
+ *  @param[in] blen Length of second name
+ *
+ *  @returns <0, 0 or >0 as a sorts before, equal to or after b
+ */
+static inline int
+far_bytes_cmp(const char *a,
+              size_t     alen,
+              const char *b,
+              size_t     blen)
+{
+  int rc = memcmp(a, b, alen < blen ? alen : blen);
+
+  if(rc != 0)
+    return rc;
+
+  return (alen > blen) - (alen < blen);
+}
+
+/*! Compare a name against an entry's name
+ *
+ *  @param[in] name  Name to compare (not necessarily NUL-terminated)
+ *  @param[in] len   Length of name
+ *  @param[in] entry Entry to compare against
+ *
+ *  @returns <0, 0 or >0 as name sorts before, equal to or after the entry
+ */
+static inline int
+far_name_cmp(const char       *name,
+             size_t           len,
+             const FARentry_t *entry)
+{
+  const char *ename;
+  char       buf[FAR_NAME_MAX+1];
+  size_t     elen;
+  int        rc;
+
+  if(far_flags & FAR_HEADER_FRONTCODED)
+  {
+    ename = far_name(entry, buf, &elen);
+    return far_bytes_cmp(name, len, ename, elen);
+  }
+
+  ename = (const char*)far_mapping + le32_to_cpu(entry->nameoff);
+  rc    = strncmp(name, ename, len);
+  if(rc != 0)
+    return rc;
+
+  /* name is a prefix of ename; they only match if ename ends here */
+  return ename[len] == '\0' ? 0 : -1;
+}
+
+/*! Lookup a name among sorted, front-coded children
+ *
+ *  The restart records hold complete names, so binary search those and
+ *  then decode forward through at most one run of FAR_NAME_RESTART.
+ *
+ *  @param[in] children     First child
+ *  @param[in] num_children Number of children
+ *  @param[in] name         Name to look for (not necessarily NUL-terminated)
+ *  @param[in] len          Length of name
+ *
+ *  @returns entry that was found
+ *  @returns NULL for no entry
+ */
+static const FARentry_t*
+far_lookup_frontcoded(const FARentry_t *children,
+                      size_t           num_children,
+                      const char       *name,
+                      size_t           len)
+{
+  const FARname_t *rec;
+  char            buf[FAR_NAME_MAX+1];
+  size_t          first = children - far_entries, end = first + num_children;
+  size_t          next  = (first / FAR_NAME_RESTART + 1) * FAR_NAME_RESTART;
+  size_t          lo, hi, mid, start, stop, i, buflen, nruns = 1;
+  int             rc;
+
+  /* the first child starts a run, and so does every restart after it */
+  if(end > next)
+    nruns += (end - next + FAR_NAME_RESTART - 1) / FAR_NAME_RESTART;
+
+  /* find the last run that starts at or before name */
+  lo = 0;
+  hi = nruns;
+  while(lo < hi)
+  {
+    mid   = lo + (hi - lo) / 2;
+    start = mid == 0 ? first : next + (mid - 1) * FAR_NAME_RESTART;
+    rec   = (const FARname_t*)((const char*)far_mapping
+                               + le32_to_cpu(far_entries[start].nameoff));
+    rc    = far_bytes_cmp(name, len, rec->suffix, rec->length);
+    if(rc == 0)
+      return far_entries + start;
+    if(rc < 0)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+
+  if(lo == 0)
+    return NULL;
+
+  /* decode forward through that run */
+  start  = lo == 1 ? first : next + (lo - 2) * FAR_NAME_RESTART;
+  stop   = lo == 1 ? next : start + FAR_NAME_RESTART;
+  stop   = stop < end ? stop : end;
+  buflen = far_name_apply(far_entries + start, buf);
+  for(i = start + 1; i < stop; ++i)
+  {
+    buflen = far_name_apply(far_entries + i, buf);
+    rc     = far_bytes_cmp(name, len, buf, buflen);
+    if(rc == 0)
+      return far_entries + i;
+    if(rc < 0)
+      break;
+  }
+
+  return NULL;
+}
+
+/*! Lookup a child of a directory
+ *
+ *  @param[in] dir  Directory to search
+ *  @param[in] name Name to look for (not necessarily NUL-terminated)
+ *  @param[in] len  Length of name
+ *
+ *  @returns entry that was found
+ *  @returns NULL for no entry
+ */
+static const FARentry_t*
+far_lookup(const FARentry_t *dir,
+           const char       *name,
+           size_t           len)
+{
+  const FARentry_t *children;
+  size_t           i, lo, hi, num_children;
+  uint32_t         hash;
+  int              rc;
+
+  /* files don't have children */
+  if(far_type(dir) != FAR_DIR_TYPE)
+    return NULL;
+
+  /* most misses never get past the filter */
+  if(!far_bloom_test(dir, far_hash(name, len)))
+    return NULL;
+
+  /* an empty directory's dataoff may point anywhere in the entry table,
+   * or just past it
+   */
+  num_children = far_datasize(dir);
+  if(num_children == 0)
+    return NULL;
+  children = far_children(dir);
+
+  if(far_flags & FAR_HEADER_SORTED)
+  {
+    if(far_flags & FAR_HEADER_FRONTCODED)
+      return far_lookup_frontcoded(children, num_children, name, len);
+
+    /* binary search the sorted children */
+    lo = 0;
+    hi = num_children;
+    while(lo < hi)
+    {
+      i  = lo + (hi - lo) / 2;
+      rc = far_name_cmp(name, len, children+i);
+      if(rc == 0)
+        return children+i;
+      if(rc < 0)
+        hi = i;
+      else
+        lo = i + 1;
+    }
+
+    return NULL;
+  }
+
+  /* look at each child for a match; stored hashes rule out nearly all of
+   * them without touching their names
+   */
+  hash = far_name_hash(name, len);
+  for(i = 0; i < num_children; ++i)
+  {
+    if(far_namehash != NULL
+    && le32_to_cpu(far_namehash[children - far_entries + i]) != hash)
+      continue;
+
+    if(far_name_cmp(name, len, children+i) == 0)
+      return children+i;
+  }
+
+  /* didn't find this entry */
+  return NULL;
+}
+
+/*! Lookup a child of a directory, ignoring case
+ *
+ *  If several children differ only by case, an exact match wins.
+ *
+ *  @param[in] dir  Directory to search
+ *  @param[in] name Name to look for (not necessarily NUL-terminated)
+ *  @param[in] len  Length of name
+ *
+ *  @returns entry that was found
+ *  @returns NULL for no entry
+ */
+static const FARentry_t*
+far_icase_lookup(const FARentry_t *dir,
+                 const char       *name,
+                 size_t           len)
+{
+  const FARentry_t *entry, *found = NULL;
+  const char       *ename;
+  char             buf[FAR_NAME_MAX+1];
+  size_t           b, elen, parent = far_slot(dir);
+  uint64_t         key;
+
+  /* files don't have children */
+  if(far_type(dir) != FAR_DIR_TYPE)
+    return NULL;
+
+  key = far_icase_key(parent, name, len);
+  for(b = key & far_icase_mask; far_icase[b].slot != 0; b = (b + 1) & far_icase_mask)
+  {
+    if(far_icase[b].tag != (uint32_t)(key >> 32) || far_icase[b].parent != parent)
+      continue;
+
+    entry = far_slot_entry(far_icase[b].slot);
+    ename = far_name(entry, buf, &elen);
+    if(elen != len || strncasecmp(name, ename, len) != 0)
+      continue;
+
+    if(memcmp(name, ename, len) == 0)
+      return entry;
+    if(found == NULL)
+      found = entry;
+  }
+
+  return found;
+}
+
+/*! Lookup a full path in the perfect hash
+ *
+ *  @param[in]  path   Path to lookup, without leading '/'
+ *  @param[out] parent Parent of entry that was found
+ *
+ *  @returns entry that was found
+ *  @returns NULL for no entry
+ */
+static const FARentry_t*
+far_phash_lookup(const char       *path,
+                 const FARentry_t **parent)
+{
+  size_t            len = strlen(path);
+  uint32_t          nbuckets = le32_to_cpu(far_phash->nbuckets);
+  uint32_t          nslots   = le32_to_cpu(far_phash->nslots);
+  uint64_t          key;
+  const FARphslot_t *slot;
+
+  key  = far_phash_key(path, len, le32_to_cpu(far_phash->seed));
+  slot = (const FARphslot_t*)(far_phash->pilots + nbuckets)
+       + far_phash_slot(key, le32_to_cpu(far_phash->pilots[far_phash_bucket(key, nbuckets)]), nslots);
+
+  /* every key lands on some slot; make sure it is ours */
+  if(strcmp(path, (const char*)far_mapping + le32_to_cpu(slot->pathoff)) != 0)
+    return NULL;
+
+  *parent = far_slot_entry(le32_to_cpu(slot->parent));
+  return far_slot_entry(le32_to_cpu(slot->slot));
+}
+
+/*! Traverse path to get entry
+ *
+ *  @param[in]  path   Path to traverse
+ *  @param[out] parent Parent of entry that was found
+ *
+ *  @returns entry that was found
+ *  @returns NULL for no entry
+ */
+static const FARentry_t*
+far_traverse_path(const char       *path,
+                  const FARentry_t **parent)
+{
+  const char       *p;
+  const FARentry_t *dir = root;
+  const FARentry_t *(*lookup)(const FARentry_t*, const char*, size_t) = far_lookup;
+
+  *parent = dir;
+
+  /* special case; this is the root directory */
+  if(strcmp(path, "/") == 0)
+    return dir;
+
+  /* case-insensitive mounts resolve one folded component at a time */
+  if(far_options.icase)
+    lookup = far_icase_lookup;
+  /* one probe answers the whole path when the archive has a perfect hash */
+  else if(far_phash != NULL)
+    return far_phash_lookup(path+1, parent);
+
+  /* iterate through intermediate path components */
+  p = strchr(++path, '/');
+  while(p != NULL)
+  {
+    dir = lookup(dir, path, p-path);
+    if(dir == NULL)
+      return NULL;
+
+    /* move to the next component */
+    path = ++p;
+    p = strchr(path, '/');
+  }
+
+  /* we are at the final component */
+  *parent = dir;
+  return lookup(dir, path, strlen(path));
+}
+
+/*! Find a block in the cache
+ *
+ *  Must be called with far_cache.lock held.
+ *
+ *  @param[in] key Block number
+ *
+ *  @returns resident or ghost block
+ *  @returns NULL if the cache does not know the block
+ */
+static far_block_t*
+far_cache_find(uint64_t key)
+{
+  far_block_t *b = far_cache.hash[far_mix64(key) & far_cache.hash_mask];
+
+  while(b != NULL && b->key != key)
+    b = b->hnext;
+
+  return b;
+}
+
+/*! Unlink a block from its list
+ *
+ *  @param[in] b Block to unlink
+ */
+static void
+far_list_remove(far_block_t *b)
+{
+  far_list_t *list = &far_cache.lists[b->list];
+
+  if(b->prev != NULL)
+    b->prev->next = b->next;
+  else
+    list->head = b->next;
+
+  if(b->next != NULL)
+    b->next->prev = b->prev;
+  else
+    list->tail = b->prev;
+
+  list->count -= 1;
+}
+
+/*! Put a block at the most recently used end of a list
+ *
+ *  @param[in] b    Block to link
+ *  @param[in] list List to link into
+ */
+static void
+far_list_push(far_block_t *b,
+              far_arc_t   list)
+{
+  far_list_t *l = &far_cache.lists[list];
+
+  b->list = list;
+  b->prev = NULL;
+  b->next = l->head;
+  if(l->head != NULL)
+    l->head->prev = b;
+  else
+    l->tail = b;
+  l->head = b;
+
+  l->count += 1;
+}
+
+/*! Forget a ghost block entirely
+ *
+ *  @param[in] b Ghost block to drop
+ */
+static void
+far_cache_drop(far_block_t *b)
+{
+  far_block_t **p = &far_cache.hash[far_mix64(b->key) & far_cache.hash_mask];
+
+  while(*p != b)
+    p = &(*p)->hnext;
+  *p = b->hnext;
+
+  far_list_remove(b);
+  free(b->data);
+  free(b);
+}
+
+/*! Evict the least recently used unpinned block of a list
+ *
+ *  @param[in] list  List to evict from (T1 or T2)
+ *  @param[in] ghost Ghost list to remember it in
+ *
+ *  @returns 0 for success
+ *  @returns -1 if every block in the list is pinned
+ */
+static int
+far_cache_evict(far_arc_t list,
+                far_arc_t ghost)
+{
+  far_block_t *b = far_cache.lists[list].tail;
+
+  while(b != NULL && b->pins != 0)
+    b = b->prev;
+  if(b == NULL)
+    return -1;
+
+  far_stat_add(FAR_STAT_CACHE_EVICT, 1);
+
+  far_list_remove(b);
+  free(b->data);
+  b->data = NULL;
+  far_list_push(b, ghost);
+
+  return 0;
+}
+
+/*! Make room for a block (ARC's REPLACE)
+ *
+ *  Evicts from T1 while it is above its target size p, otherwise from T2.
+ *  If everything on the preferred side is pinned the other side gives way;
+ *  if everything is pinned the cache briefly grows past its capacity.
+ *
+ *  @param[in] in_b2 Whether the block being brought in was a B2 ghost
+ *
+ *  @returns 0 for success
+ *  @returns -1 if every block is pinned
+ */
+static int
+far_cache_replace(int in_b2)
+{
+  size_t t1 = far_cache.lists[FAR_ARC_T1].count;
+
+  if(t1 != 0 && (t1 > far_cache.p || (in_b2 && t1 == far_cache.p)))
+  {
+    if(far_cache_evict(FAR_ARC_T1, FAR_ARC_B1) != 0)
+      return far_cache_evict(FAR_ARC_T2, FAR_ARC_B2);
+  }
+  else if(far_cache_evict(FAR_ARC_T2, FAR_ARC_B2) != 0)
+    return far_cache_evict(FAR_ARC_T1, FAR_ARC_B1);
+
+  return 0;
+}
+
+/*! Account for a miss and make a block resident, ready to be filled
+ *
+ *  Must be called with far_cache.lock held.
+ *
+ *  @param[in] key Block key
+ *
+ *  @returns block, pinned and marked as loading
+ *  @returns NULL for failure
+ */
+static far_block_t*
+far_cache_insert(uint64_t key)
+{
+  far_list_t  *lists = far_cache.lists;
+  far_block_t *b = far_cache_find(key);
+  size_t      c = far_cache.capacity, l1, l2, delta;
+
+  if(b != NULL && b->list == FAR_ARC_B1)
+  {
+    /* recency would have kept it; grow T1's share */
+    delta = lists[FAR_ARC_B2].count / lists[FAR_ARC_B1].count;
+    far_cache.p = far_cache.p + (delta ? delta : 1) > c ? c : far_cache.p + (delta ? delta : 1);
+    far_cache_replace(0);
+    far_list_remove(b);
+    far_list_push(b, FAR_ARC_T2);
+  }
+  else if(b != NULL)
+  {
+    /* frequency would have kept it; grow T2's share */
+    delta = lists[FAR_ARC_B1].count / lists[FAR_ARC_B2].count;
+    far_cache.p = far_cache.p < (delta ? delta : 1) ? 0 : far_cache.p - (delta ? delta : 1);
+    far_cache_replace(1);
+    far_list_remove(b);
+    far_list_push(b, FAR_ARC_T2);
+  }
+  else
+  {
+    /* keep T1+B1 and the whole directory within their bounds */
+    l1 = lists[FAR_ARC_T1].count + lists[FAR_ARC_B1].count;
+    l2 = lists[FAR_ARC_T2].count + lists[FAR_ARC_B2].count;
+    if(l1 >= c)
+    {
+      if(lists[FAR_ARC_B1].count != 0)
+      {
+        far_cache_drop(lists[FAR_ARC_B1].tail);
+        far_cache_replace(0);
+      }
+      else if(far_cache_evict(FAR_ARC_T1, FAR_ARC_B1) == 0)
+        far_cache_drop(lists[FAR_ARC_B1].tail);
+    }
+    else if(l1 + l2 >= c)
+    {
+      if(l1 + l2 >= 2 * c && lists[FAR_ARC_B2].count != 0)
+        far_cache_drop(lists[FAR_ARC_B2].tail);
+      far_cache_replace(0);
+    }
+
+    b = (far_block_t*)calloc(1, sizeof(far_block_t));
+    if(b == NULL)
+      return NULL;
+
+    b->key   = key;
+    b->hnext = far_cache.hash[far_mix64(key) & far_cache.hash_mask];
+    far_cache.hash[far_mix64(key) & far_cache.hash_mask] = b;
+    far_list_push(b, FAR_ARC_T1);
+  }
+
+  b->data    = NULL;
+  b->size    = 0;
+  b->pins    = 1;
+  b->loading = 1;
+  return b;
+}
+
+/*! Get the memory used by the mount-time index
+ *
+ *  @returns bytes used
+ */
+static size_t
+far_index_usage(void)
+{
+  size_t i, total = 0;
+
+  for(i = 0; i < FAR_NUM_SEGMENTS; ++i)
+    total += *far_segments[i].size;
+
+  return total;
+}
+
+/*! Get the memory used by the block cache
+ *
+ *  @returns bytes used
+ */
+static size_t
+far_cache_usage(void)
+{
+  size_t resident;
+
+  pthread_mutex_lock(&far_cache.lock);
+  resident = far_cache.lists[FAR_ARC_T1].count + far_cache.lists[FAR_ARC_T2].count;
+  pthread_mutex_unlock(&far_cache.lock);
+
+  return resident * FAR_BLOCK_SIZE;
+}
+
+/*! Get the last use of the block cache's coldest block
+ *
+ *  @returns far_tick of the coldest block
+ *  @returns UINT64_MAX if nothing can be evicted
+ */
+static uint64_t
+far_cache_coldest(void)
+{
+  uint64_t    coldest = UINT64_MAX;
+  far_arc_t   list;
+  far_block_t *b;
+
+  pthread_mutex_lock(&far_cache.lock);
+  for(list = FAR_ARC_T1; list <= FAR_ARC_T2; ++list)
+  {
+    b = far_cache.lists[list].tail;
+    if(b != NULL && b->atime < coldest)
+      coldest = b->atime;
+  }
+  pthread_mutex_unlock(&far_cache.lock);
+
+  return coldest;
+}
+
+/*! Evict from the block cache
+ *
+ *  @param[in] bytes Bytes to free
+ *
+ *  @returns bytes freed
+ */
+static size_t
+far_cache_shrink(size_t bytes)
+{
+  size_t freed = 0;
+
+  pthread_mutex_lock(&far_cache.lock);
+  while(freed < bytes && far_cache_replace(0) == 0)
+    freed += FAR_BLOCK_SIZE;
+  pthread_mutex_unlock(&far_cache.lock);
+
+  return freed;
+}
+
+/*! Memory pool under the governor */
+typedef struct far_pool_t
+{
+  const char *name;               /*!< pool name */
+  size_t     (*usage)(void);      /*!< bytes used */
+  uint64_t   (*coldest)(void);    /*!< last use of coldest item (NULL: fixed) */
+  size_t     (*shrink)(size_t);   /*!< evict coldest items; returns bytes freed */
+} far_pool_t;
+
+/*! Memory pools, sharing the mem_limit budget */
+static const far_pool_t far_pools[] =
+{
+  { "index", far_index_usage, NULL,              NULL,             },
+  { "cache", far_cache_usage, far_cache_coldest, far_cache_shrink, },
+};
+
+/*! Number of memory pools */
+#define FAR_NUM_POOLS (sizeof(far_pools) / sizeof(far_pools[0]))
+
+/*! Get the memory used by all pools
+ *
+ *  @returns bytes used
+ */
+static size_t
+far_mem_usage(void)
+{
+  size_t i, total = 0;
+
+  for(i = 0; i < FAR_NUM_POOLS; ++i)
+    total += far_pools[i].usage();
+
+  return total;
+}
+
+/*! Get the budget currently in force
+ *
+ *  @returns bytes allowed; 0 for no limit
+ */
+static size_t
+far_mem_budget(void)
+{
+  uint64_t limit = __atomic_load_n(&far_mem_limit, __ATOMIC_RELAXED);
+
+  return limit * __atomic_load_n(&far_mem_scale, __ATOMIC_RELAXED) / FAR_MEM_SCALE;
+}
+
+/*! Cancel prefetches
+ *
+ *  Queued prefetches are dropped; running ones stop after their current
+ *  chunk.
+ *
+ *  @param[in] owner Owner whose prefetches to cancel
+ *  @param[in] all   Whether to cancel every prefetch instead
+ */
+static void
+far_io_drop(size_t owner,
+            int    all)
+{
+  far_io_t **link, *io;
+
+  pthread_mutex_lock(&far_io.lock);
+
+  link = &far_io.head[FAR_IO_PREFETCH];
+  while((io = *link) != NULL)
+  {
+    if(all || io->owner == owner)
+    {
+      *link = io->next;
+      far_io.queued_count[FAR_IO_PREFETCH] -= 1;
+      far_stat_add(FAR_STAT_PREFETCH_CANCEL, 1);
+      free(io);
+    }
+    else
+      link = &io->next;
+  }
+  far_io.tail[FAR_IO_PREFETCH] = link;
+
+  for(io = far_io.running; io != NULL; io = io->next)
+  {
+    if(all || io->owner == owner)
+      io->cancelled = 1;
+  }
+
+  pthread_cond_broadcast(&far_io.room);
+  pthread_mutex_unlock(&far_io.lock);
+}
+
+/*! Cancel the prefetches of a file
+ *
+ *  @param[in] slot Slot of file
+ */
+static void
+far_io_cancel(size_t slot)
+{
+  far_io_drop(slot + 1, 0);
+}
+
+/*! Cancel every prefetch */
+static void
+far_io_cancel_all(void)
+{
+  far_io_drop(0, 1);
+}
+
+/*! Bring the pools back within the budget, coldest pool first */
+static void
+far_governor_enforce(void)
+{
+  size_t   i, total, budget = far_mem_budget(), freed;
+  uint64_t coldest, c;
+  int      victim;
+
+  if(budget == 0)
+    return;
+
+  /* speculation is the first thing to go once we are over */
+  if((total = far_mem_usage()) > budget)
+    far_io_cancel_all();
+
+  for(; total > budget; total -= freed)
+  {
+    /* whichever pool has gone longest without using its coldest item */
+    victim  = -1;
+    coldest = UINT64_MAX;
+    for(i = 0; i < FAR_NUM_POOLS; ++i)
+    {
+      if(far_pools[i].coldest != NULL && (c = far_pools[i].coldest()) < coldest)
+      {
+        coldest = c;
+        victim  = i;
+      }
+    }
+
+    if(victim < 0)
+      return;
+
+    freed = far_pools[victim].shrink(total - budget);
+    if(freed == 0)
+      return;
+  }
+}
+
+/*! Arm a PSI memory pressure trigger
+ *
+ *  @param[in] path memory.pressure file
+ *
+ *  @returns file descriptor to poll for POLLPRI
+ *  @returns -1 for failure
+ */
+static int
+far_psi_trigger(const char *path)
+{
+  int fd = open(path, O_RDWR | O_NONBLOCK);
+
+  if(fd < 0)
+    return -1;
+
+  if(write(fd, FAR_PSI_TRIGGER, sizeof(FAR_PSI_TRIGGER)) < 0)
+  {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+/*! Arm a PSI memory pressure trigger for our cgroup, or failing that for
+ *  the whole system
+ *
+ *  @returns file descriptor to poll for POLLPRI
+ *  @returns -1 if PSI is not available
+ */
+static int
+far_psi_open(void)
+{
+  char line[PATH_MAX], path[PATH_MAX + 64];
+  FILE *fp;
+  int  fd = -1;
+
+  fp = fopen("/proc/self/cgroup", "r");
+  if(fp != NULL)
+  {
+    /* the cgroup v2 entry is "0::/path" */
+    while(fd < 0 && fgets(line, sizeof(line), fp) != NULL)
+    {
+      if(strncmp(line, "0::", 3) != 0)
+        continue;
+
+      line[strcspn(line, "\n")] = '\0';
+      snprintf(path, sizeof(path), "/sys/fs/cgroup%s/memory.pressure", line + 3);
+      fd = far_psi_trigger(path);
+    }
+    fclose(fp);
+  }
+
+  if(fd < 0)
+    fd = far_psi_trigger("/proc/pressure/memory");
+
+  return fd;
+}
+
+/*! Memory governor thread
+ *
+ *  Each PSI event cuts the budget by a quarter, down to an eighth of
+ *  mem_limit, and evicts down to it. After FAR_PSI_RECOVER quiet seconds
+ *  the budget grows back by an eighth of mem_limit at a time.
+ *
+ *  @param[in] arg Unused
+ *
+ *  @returns NULL
+ */
+static void*
+far_governor(void *arg)
+{
+  struct pollfd pfd = { far_psi_fd, POLLPRI, 0 };
+  unsigned      scale, quiet = 0;
+  int           rc;
+
+  while(!__atomic_load_n(&far_governor_stop, __ATOMIC_RELAXED))
+  {
+    rc    = poll(&pfd, 1, 1000);
+    scale = __atomic_load_n(&far_mem_scale, __ATOMIC_RELAXED);
+
+    /* the cgroup went away */
+    if(rc > 0 && (pfd.revents & POLLERR))
+      break;
+
+    if(rc > 0 && (pfd.revents & POLLPRI))
+    {
+      far_stat_add(FAR_STAT_MEM_PRESSURE, 1);
+      scale = scale * 3 / 4 < FAR_MEM_SCALE / 8 ? FAR_MEM_SCALE / 8 : scale * 3 / 4;
+      quiet = 0;
+    }
+    else if(scale < FAR_MEM_SCALE && ++quiet >= FAR_PSI_RECOVER)
+    {
+      scale = scale + FAR_MEM_SCALE / 8 > FAR_MEM_SCALE ? FAR_MEM_SCALE : scale + FAR_MEM_SCALE / 8;
+      quiet = 0;
+    }
+    else
+      continue;
+
+    __atomic_store_n(&far_mem_scale, scale, __ATOMIC_RELAXED);
+    far_governor_enforce();
+  }
+
+  return NULL;
+}
+
+/*! Read a block of the archive
+ *
+ *  @param[in]  key  Block number
+ *  @param[out] data Block data
+ *  @param[out] size Valid bytes of data; the last block may be short
+ *
+ *  @returns 0 for success
+ *  @returns negated errno otherwise
+ */
+static int
+far_cache_fill_archive(uint64_t key,
+                       char     **data,
+                       size_t   *size)
+{
+  ssize_t rc;
+  void    *p;
+
+  /* O_DIRECT wants aligned buffers */
+  if(posix_memalign(&p, FAR_DIRECT_ALIGN, FAR_BLOCK_SIZE) != 0)
+    return -ENOMEM;
+
+  rc = pread(far_direct_fd, p, FAR_BLOCK_SIZE, key * FAR_BLOCK_SIZE);
+  if(rc < 0)
+  {
+    rc = -errno;
+    free(p);
+    return rc;
+  }
+
+  *data = (char*)p;
+  *size = rc;
+  return 0;
+}
+
+/*! Get a block, filling it if it is not cached
+ *
+ *  Fills are single-flight: while one thread fills a block, every other
+ *  thread that wants it waits for that fill instead of doing its own.
+ *
+ *  @param[in]  key  Block key
+ *  @param[in]  fill Fill function for key, or NULL to only take a resident
+ *                   block
+ *  @param[out] b    Block, pinned; release with far_cache_put
+ *
+ *  @returns 0 for success
+ *  @returns -EAGAIN if fill is NULL and the block is not resident
+ *  @returns negated errno otherwise
+ */
+static int
+far_cache_get(uint64_t    key,
+              far_fill_t  fill,
+              far_block_t **b)
+{
+  char   *data  = NULL;
+  size_t size   = 0;
+  int    waited = 0;
+  int    rc;
+
+  pthread_mutex_lock(&far_cache.lock);
+  *b = far_cache_find(key);
+  if(fill == NULL
+  && (*b == NULL || (*b)->list > FAR_ARC_T2 || (*b)->loading || (*b)->data == NULL))
+  {
+    pthread_mutex_unlock(&far_cache.lock);
+    return -EAGAIN;
+  }
+
+  if(*b != NULL && (*b)->list <= FAR_ARC_T2)
+  {
+    /* a hit makes it frequent */
+    far_list_remove(*b);
+    far_list_push(*b, FAR_ARC_T2);
+    (*b)->pins += 1;
+    (*b)->atime = __atomic_add_fetch(&far_tick, 1, __ATOMIC_RELAXED);
+
+    if((*b)->loading)
+    {
+      far_stat_add(FAR_STAT_CACHE_WAIT, 1);
+      waited = 1;
+      while((*b)->loading)
+        pthread_cond_wait(&far_cache.filled, &far_cache.lock);
+    }
+
+    if((*b)->data != NULL)
+    {
+      far_stat_add(FAR_STAT_CACHE_HIT, 1);
+      pthread_mutex_unlock(&far_cache.lock);
+      return 0;
+    }
+
+    /* the fill failed; its waiters report that, later requests retry */
+    if(waited)
+    {
+      rc = (*b)->error;
+      (*b)->pins -= 1;
+      pthread_mutex_unlock(&far_cache.lock);
+      return rc;
+    }
+    (*b)->loading = 1;
+  }
+  else if((*b = far_cache_insert(key)) == NULL)
+  {
+    pthread_mutex_unlock(&far_cache.lock);
+    return -ENOMEM;
+  }
+  else
+    (*b)->atime = __atomic_add_fetch(&far_tick, 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&far_cache.lock);
+
+  far_stat_add(FAR_STAT_CACHE_MISS, 1);
+  rc = fill(key, &data, &size);
+
+  pthread_mutex_lock(&far_cache.lock);
+  (*b)->data    = data;
+  (*b)->size    = size;
+  (*b)->error   = rc;
+  (*b)->loading = 0;
+  if(rc != 0)
+    (*b)->pins -= 1;
+  pthread_cond_broadcast(&far_cache.filled);
+  pthread_mutex_unlock(&far_cache.lock);
+
+  if(rc != 0)
+    return rc;
+
+  /* the cache grew; make room elsewhere if that broke the budget */
+  far_governor_enforce();
+
+  return 0;
+}
+
+/*! Release a block from far_cache_get
+ *
+ *  @param[in] b Block to release
+ */
+static void
+far_cache_put(far_block_t *b)
+{
+  pthread_mutex_lock(&far_cache.lock);
+  b->pins -= 1;
+  pthread_mutex_unlock(&far_cache.lock);
+}
+
+/*! Read part of the archive through the block cache
+ *
+ *  @param[in]  offset Offset (from header) to start at
+ *  @param[out] buffer Buffer to fill
+ *  @param[in]  size   Number of bytes
+ *  @param[in]  fill   far_cache_fill_archive, or NULL to stop at the first
+ *                     block that is not resident
+ *
+ *  @returns number of bytes read
+ *  @returns negated errno otherwise
+ */
+static ssize_t
+far_cache_read(off_t      offset,
+               char       *buffer,
+               size_t     size,
+               far_fill_t fill)
+{
+  far_block_t *b;
+  size_t      done, pos, len;
+  int         rc;
+
+  for(done = 0; done < size; done += len)
+  {
+    rc = far_cache_get((offset + done) / FAR_BLOCK_SIZE, fill, &b);
+    if(rc == -EAGAIN && done != 0)
+      return done;
+    if(rc != 0)
+      return rc;
+
+    pos = (offset + done) % FAR_BLOCK_SIZE;
+    len = size - done < FAR_BLOCK_SIZE - pos ? size - done : FAR_BLOCK_SIZE - pos;
+    if(pos + len > b->size)
+    {
+      /* the archive is shorter than validated; it changed under us */
+      far_cache_put(b);
+      return -EIO;
+    }
+
+    memcpy(buffer + done, b->data + pos, len);
+    far_cache_put(b);
+  }
+
+  return done;
+}
+
+/*! Set up the block cache
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+far_cache_init(void)
+{
+  size_t nhash = 16;
+
+  far_cache.capacity = far_options.cache_size / FAR_BLOCK_SIZE;
+  if(far_cache.capacity < 1)
+    far_cache.capacity = 1;
+
+  /* the directory holds up to twice the capacity, counting ghosts */
+  while(nhash < 2 * far_cache.capacity)
+    nhash <<= 1;
+
+  far_cache.hash = (far_block_t**)calloc(nhash, sizeof(far_block_t*));
+  if(far_cache.hash == NULL)
+    return -1;
+  far_cache.hash_mask = nhash - 1;
+
+  return 0;
+}
+
+/*! Tear down the block cache */
+static void
+far_cache_free(void)
+{
+  far_arc_t list;
+
+  if(far_cache.hash == NULL)
+    return;
+
+  for(list = 0; list < FAR_ARC_MAX; ++list)
+  {
+    while(far_cache.lists[list].tail != NULL)
+      far_cache_drop(far_cache.lists[list].tail);
+  }
+
+  free(far_cache.hash);
+  far_cache.hash = NULL;
+}
+
+/*! Read part of the archive, blocking if it is not in memory
+ *
+ *  @param[in]  offset Offset (from header) to start at
+ *  @param[out] buffer Buffer to fill
+ *  @param[in]  size   Number of bytes
+ *
+ *  @returns number of bytes read
+ *  @returns negated errno otherwise
+ */
+static ssize_t
+far_io_read(off_t  offset,
+            char   *buffer,
+            size_t size)
+{
+  size_t  done;
+  ssize_t rc;
+
+  if(far_direct)
+    return far_cache_read(offset, buffer, size, far_cache_fill_archive);
+
+  for(done = 0; done < size; done += rc)
+  {
+    rc = pread(far_fd, buffer + done, size - done, offset + done);
+    if(rc < 0 && errno == EINTR)
+      rc = 0;
+    else if(rc < 0)
+      return -errno;
+    else if(rc == 0)
+      break;
+  }
+
+  return done;
+}
+
+/*! Prefetch part of the archive
+ *
+ *  With the mmap backend the readahead is started in the background and
+ *  this does not wait for it. With backend=direct the blocks are read into
+ *  the block cache before this returns.
+ *
+ *  @param[in] offset Offset (from header) to start at
+ *  @param[in] size   Number of bytes
+ */
+static void
+far_prefetch_run(off_t  offset,
+                 size_t size)
+{
+  far_block_t *b;
+  uint64_t    key;
+
+  if(!far_direct)
+  {
+    posix_fadvise(far_fd, offset, size, POSIX_FADV_WILLNEED);
+    return;
+  }
+
+  for(key = offset / FAR_BLOCK_SIZE; key * FAR_BLOCK_SIZE < offset + size; ++key)
+  {
+    if(far_cache_get(key, far_cache_fill_archive, &b) != 0)
+      break;
+    far_cache_put(b);
+  }
+}
+
+/*! Take the next work for an I/O thread
+ *
+ *  Reads always go first. Prefetches are only taken while fewer than
+ *  prefetch_depth are running.
+ *
+ *  Must be called with far_io.lock held.
+ *
+ *  @returns work
+ *  @returns NULL if there is nothing to take
+ */
+static far_io_t*
+far_io_take(void)
+{
+  far_io_class_t cls = FAR_IO_READ;
+  far_io_t       *io;
+
+  if(far_io.head[cls] == NULL)
+  {
+    cls = FAR_IO_PREFETCH;
+    if(far_io.active[cls] >= far_options.prefetch_depth)
+      return NULL;
+  }
+
+  io = far_io.head[cls];
+  if(io == NULL)
+    return NULL;
+
+  far_io.head[cls] = io->next;
+  if(far_io.head[cls] == NULL)
+    far_io.tail[cls] = &far_io.head[cls];
+  far_io.queued_count[cls] -= 1;
+  far_io.active[cls]       += 1;
+
+  if(cls == FAR_IO_PREFETCH)
+  {
+    io->next       = far_io.running;
+    far_io.running = io;
+    pthread_cond_broadcast(&far_io.room);
+  }
+
+  return io;
+}
+
+/*! Finish a chunk of a prefetch
+ *
+ *  Must be called with far_io.lock held.
+ *
+ *  @param[in] io  Prefetch
+ *  @param[in] len Bytes just prefetched
+ */
+static void
+far_io_prefetched(far_io_t *io,
+                  size_t   len)
+{
+  far_io_t **link;
+
+  for(link = &far_io.running; *link != io; link = &(*link)->next)
+    ;
+  *link = io->next;
+
+  io->offset += len;
+  io->size   -= len;
+  if(io->size != 0 && io->cancelled)
+    far_stat_add(FAR_STAT_PREFETCH_CANCEL, 1);
+
+  if(io->size == 0 || io->cancelled)
+  {
+    free(io);
+    return;
+  }
+
+  /* go to the back of the line, behind any reads that came in meanwhile,
+   * but ahead of the other prefetches so each one finishes in order
+   */
+  io->next = far_io.head[FAR_IO_PREFETCH];
+  far_io.head[FAR_IO_PREFETCH] = io;
+  if(far_io.tail[FAR_IO_PREFETCH] == &far_io.head[FAR_IO_PREFETCH])
+    far_io.tail[FAR_IO_PREFETCH] = &io->next;
+  far_io.queued_count[FAR_IO_PREFETCH] += 1;
+}
+
+/*! I/O thread
+ *
+ *  @param[in] arg Unused
+ *
+ *  @returns NULL
+ */
+static void*
+far_io_worker(void *arg)
+{
+  far_io_t *io;
+  size_t   len;
+
+  pthread_mutex_lock(&far_io.lock);
+  while(1)
+  {
+    while(!far_io.stop && (io = far_io_take()) == NULL)
+      pthread_cond_wait(&far_io.queued, &far_io.lock);
+    if(far_io.stop)
+      break;
+    pthread_mutex_unlock(&far_io.lock);
+
+    if(io->cls == FAR_IO_READ)
+      io->rc = far_io_read(io->offset, io->buffer, io->size);
+    else
+    {
+      len = io->size < FAR_PREFETCH_CHUNK ? io->size : FAR_PREFETCH_CHUNK;
+      far_prefetch_run(io->offset, len);
+    }
+
+    pthread_mutex_lock(&far_io.lock);
+    far_io.active[io->cls] -= 1;
+    if(io->cls == FAR_IO_READ)
+    {
+      io->done = 1;
+      pthread_cond_broadcast(&far_io.done);
+    }
+    else
+    {
+      far_io_prefetched(io, len);
+
+      /* a prefetch slot is free again */
+      pthread_cond_signal(&far_io.queued);
+    }
+  }
+  pthread_mutex_unlock(&far_io.lock);
+
+  return NULL;
+}
+
+/*! Start the I/O pool
+ *
+ *  Threads do not survive daemonizing, so this is called from far_init. If
+ *  no thread starts, reads that would block are done by the caller.
+ */
+static void
+far_io_start(void)
+{
+  unsigned i;
+
+  far_io.threads = (pthread_t*)calloc(far_options.io_threads, sizeof(pthread_t));
+  if(far_io.threads == NULL)
+    return;
+
+  for(i = 0; i < far_options.io_threads; ++i)
+  {
+    if(pthread_create(&far_io.threads[i], NULL, far_io_worker, NULL) != 0)
+      break;
+  }
+  far_io.nthreads = i;
+}
+
+/*! Stop the I/O pool, dropping any prefetches left */
+static void
+far_io_stop(void)
+{
+  unsigned i;
+
+  pthread_mutex_lock(&far_io.lock);
+  far_io.stop = 1;
+  pthread_cond_broadcast(&far_io.queued);
+  pthread_cond_broadcast(&far_io.room);
+  pthread_mutex_unlock(&far_io.lock);
+
+  for(i = 0; i < far_io.nthreads; ++i)
+    pthread_join(far_io.threads[i], NULL);
+
+  far_io_cancel_all();
+
+  free(far_io.threads);
+  far_io.threads  = NULL;
+  far_io.nthreads = 0;
+}
+
+/*! Read part of the archive
+ *
+ *  Whatever is already in memory is copied right away. The rest is read by
+ *  the I/O pool, so at most io_threads reads wait on the disk at once and
+ *  the FUSE workers beyond those stay free for lookups and getattr.
+ *
+ *  @param[in]  offset Offset (from header) to start at
+ *  @param[out] buffer Buffer to fill
+ *  @param[in]  size   Number of bytes
+ *
+ *  @returns number of bytes read
+ *  @returns negated errno otherwise
+ */
+static ssize_t
+far_read_data(off_t  offset,
+              char   *buffer,
+              size_t size)
+{
+  struct iovec iov = { .iov_base = buffer, .iov_len = size };
+  far_io_t     io;
+  ssize_t      rc;
+
+  if(far_direct)
+    rc = far_cache_read(offset, buffer, size, NULL);
+  else
+    rc = preadv2(far_fd, &iov, 1, offset, RWF_NOWAIT);
+
+  /* on any error, including an old kernel, let the pool try */
+  if(rc < 0)
+    rc = 0;
+  if((size_t)rc == size)
+    return rc;
+
+  far_stat_add(FAR_STAT_IO_POOL, 1);
+
+  io.cls    = FAR_IO_READ;
+  io.offset = offset + rc;
+  io.buffer = buffer + rc;
+  io.size   = size - rc;
+  io.done   = 0;
+  io.next   = NULL;
+
+  pthread_mutex_lock(&far_io.lock);
+  if(far_io.nthreads == 0)
+  {
+    pthread_mutex_unlock(&far_io.lock);
+    io.rc = far_io_read(io.offset, io.buffer, io.size);
+  }
+  else
+  {
+    *far_io.tail[FAR_IO_READ] = &io;
+    far_io.tail[FAR_IO_READ]  = &io.next;
+    far_io.queued_count[FAR_IO_READ] += 1;
+    pthread_cond_signal(&far_io.queued);
+    while(!io.done)
+      pthread_cond_wait(&far_io.done, &far_io.lock);
+    pthread_mutex_unlock(&far_io.lock);
+  }
+
+  if(io.rc < 0)
+    return io.rc;
+
+  return rc + io.rc;
+}
+
+/*! Get a decompression context
+ *
+ *  @returns context; give it back with far_dctx_put
+ *  @returns NULL for failure
+ */
+static ZSTD_DCtx*
+far_dctx_get(void)
+{
+  ZSTD_DCtx *dctx = NULL;
+
+  pthread_mutex_lock(&far_zstd.lock);
+  if(far_zstd.nidle != 0)
+    dctx = far_zstd.idle[--far_zstd.nidle];
+  pthread_mutex_unlock(&far_zstd.lock);
+
+  return dctx != NULL ? dctx : ZSTD_createDCtx();
+}
+
+/*! Give back a decompression context from far_dctx_get
+ *
+ *  @param[in] dctx Context
+ */
+static void
+far_dctx_put(ZSTD_DCtx *dctx)
+{
+  pthread_mutex_lock(&far_zstd.lock);
+  if(far_zstd.nidle < FAR_ZSTD_IDLE)
+  {
+    far_zstd.idle[far_zstd.nidle++] = dctx;
+    dctx = NULL;
+  }
+  pthread_mutex_unlock(&far_zstd.lock);
+
+  ZSTD_freeDCtx(dctx);
+}
+
+/*! Fill the block cache with a decompressed solid block
+ *
+ *  @param[in]  key  FAR_SOLID_KEY | solid block
+ *  @param[out] data Block data
+ *  @param[out] size Valid bytes of data
+ *
+ *  @returns 0 for success
+ *  @returns negated errno otherwise
+ */
+static int
+far_cache_fill_solid(uint64_t key,
+                     char     **data,
+                     size_t   *size)
+{
+  size_t           index = key & ~FAR_SOLID_KEY, csize, rc;
+  const FARblock_t *block = far_blocks + index;
+  ZSTD_DCtx        *dctx;
+  char             *frame;
+  ssize_t          len;
+
+  csize = le32_to_cpu(block->size);
+  *size = le32_to_cpu(block->end) - far_solid_start(index);
+  frame = (char*)malloc(csize);
+  *data = (char*)malloc(*size);
+  if(frame == NULL || *data == NULL)
+  {
+    free(frame);
+    free(*data);
+    return -ENOMEM;
+  }
+
+  len = far_read_data(le32_to_cpu(block->offset), frame, csize);
+  if(len >= 0 && (size_t)len != csize)
+    len = -EIO;
+
+  if(len >= 0 && (dctx = far_dctx_get()) == NULL)
+    len = -ENOMEM;
+
+  if(len >= 0)
+  {
+    rc = ZSTD_decompressDCtx(dctx, *data, *size, frame, csize);
+    if(ZSTD_isError(rc) || rc != *size)
+      len = -EIO;
+    far_dctx_put(dctx);
+  }
+
+  free(frame);
+  if(len < 0)
+  {
+    free(*data);
+    return len;
+  }
+
+  return 0;
+}
+
+/*! Read part of a solid file
+ *
+ *  The whole block is decompressed into the block cache, where it serves
+ *  the file's siblings as well.
+ *
+ *  @param[in]  entry  File
+ *  @param[in]  offset Offset into the file
+ *  @param[out] buffer Buffer to fill
+ *  @param[in]  size   Number of bytes, within the file
+ *
+ *  @returns number of bytes read
+ *  @returns negated errno otherwise
+ */
+static ssize_t
+far_read_solid(const FARentry_t *entry,
+               size_t           offset,
+               char             *buffer,
+               size_t           size)
+{
+  far_block_t *b;
+  size_t      pos = le32_to_cpu(entry->dataoff) + offset, block;
+  int         rc;
+
+  if(size == 0)
+    return 0;
+
+  block = far_solid_block(pos);
+  rc    = far_cache_get(FAR_SOLID_KEY | block, far_cache_fill_solid, &b);
+  if(rc != 0)
+    return rc;
+
+  memcpy(buffer, b->data + pos - far_solid_start(block), size);
+  far_cache_put(b);
+
+  return size;
+}
+
+/*! Read part of a compressed file
+ *
+ *  The whole frame is decompressed every time; compressed files are small
+ *  and the kernel caches what we return.
+ *
+ *  @param[in]  entry  File
+ *  @param[in]  offset Offset into the file
+ *  @param[out] buffer Buffer to fill
+ *  @param[in]  size   Number of bytes, within the file
+ *
+ *  @returns number of bytes read
+ *  @returns negated errno otherwise
+ */
+static ssize_t
+far_read_zstd(const FARentry_t *entry,
+              size_t           offset,
+              char             *buffer,
+              size_t           size)
+{
+  FARzstd_t record;
+  ZSTD_DCtx *dctx;
+  char      *frame, *data = buffer;
+  size_t    csize, rc;
+  ssize_t   len;
+
+  if(size == 0)
+    return 0;
+
+  len = far_read_data(le32_to_cpu(entry->dataoff), (char*)&record, sizeof(record));
+  if(len < 0)
+    return len;
+
+  /* mkfar only compresses a file if that makes it smaller */
+  csize = le32_to_cpu(record.size);
+  if(len != sizeof(record) || csize >= far_datasize(entry))
+    return -EIO;
+
+  frame = (char*)malloc(csize);
+  if(frame == NULL)
+    return -ENOMEM;
+
+  /* decompress in place when the whole file is wanted */
+  if(offset != 0 || size != far_datasize(entry))
+  {
+    data = (char*)malloc(far_datasize(entry));
+    if(data == NULL)
+    {
+      free(frame);
+      return -ENOMEM;
+    }
+  }
+
+  len = far_read_data(le32_to_cpu(entry->dataoff) + sizeof(record), frame, csize);
+  if(len >= 0 && (size_t)len != csize)
+    len = -EIO;
+
+  if(len >= 0 && (dctx = far_dctx_get()) == NULL)
+    len = -ENOMEM;
+
+  if(len >= 0)
+  {
+    rc = ZSTD_decompress_usingDDict(dctx, data, far_datasize(entry), frame, csize,
+                                    far_zstd.ddict);
+    if(ZSTD_isError(rc) || rc != far_datasize(entry))
+      len = -EIO;
+    else
+    {
+      if(data != buffer)
+        memcpy(buffer, data + offset, size);
+      len = size;
+    }
+
+    far_dctx_put(dctx);
+  }
+
+  if(data != buffer)
+    free(data);
+  free(frame);
+
+  return len;
+}
+
+/*! Read part of a file
+ *
+ *  @param[in]  entry  File
+ *  @param[in]  offset Offset into the file
+ *  @param[out] buffer Buffer to fill
+ *  @param[in]  size   Number of bytes, within the file
+ *
+ *  @returns number of bytes read
+ *  @returns negated errno otherwise
+ */
+static ssize_t
+far_read_file(const FARentry_t *entry,
+              size_t           offset,
+              char             *buffer,
+              size_t           size)
+{
+  size_t  done, len;
+  ssize_t rc;
+  off_t   pos;
+
+  if(le32_to_cpu(entry->flags) & FAR_ENTRY_ZSTD)
+    return far_read_zstd(entry, offset, buffer, size);
+  if(le32_to_cpu(entry->flags) & FAR_ENTRY_SOLID)
+    return far_read_solid(entry, offset, buffer, size);
+
+  /* an inline file lies among the names, which stay mapped */
+  if(le32_to_cpu(entry->flags) & FAR_ENTRY_INLINE)
+  {
+    memcpy(buffer, far_data(entry) + offset, size);
+    return size;
+  }
+
+  for(done = 0; done < size; done += rc)
+  {
+    len = far_extent(entry, offset + done, &pos);
+    if(len > size - done)
+      len = size - done;
+
+    rc = far_read_data(pos, buffer + done, len);
+    if(rc < 0)
+      return rc;
+    if(rc == 0)
+      break;
+  }
+
+  return done;
+}
+
+/*! Check whether part of the archive is in the page cache
+ *
+ *  Without write permission on the archive the kernel only reports pages we
+ *  have mapped, so data may be resident without this knowing it.
+ *
+ *  @param[in] offset Offset (from header) to start at
+ *  @param[in] size   Number of bytes
+ *
+ *  @returns whether every page is resident
+ */
+static int
+far_resident(off_t  offset,
+             size_t size)
+{
+  unsigned char vec[FAR_MAX_REQUEST / 4096 + 2];
+  size_t        page = sysconf(_SC_PAGESIZE);
+  size_t        start, npages, i;
+
+  if(size == 0)
+    return 1;
+
+  start  = offset & ~(page - 1);
+  npages = (offset + size - start + page - 1) / page;
+  if(npages > sizeof(vec)
+  || mincore((char*)far_mapping + start, npages * page, vec) != 0)
+    return 0;
+
+  for(i = 0; i < npages; ++i)
+  {
+    if(!(vec[i] & 1))
+      return 0;
+  }
+
+  return 1;
+}
+
+/*! Prefetch part of the archive in the background
+ *
+ *  The I/O pool runs prefetches behind every read, a chunk at a time.
+ *
+ *  @param[in] offset Offset (from header) to start at
+ *  @param[in] size   Number of bytes
+ *  @param[in] owner  Slot + 1 of the file whose release cancels the
+ *                    prefetch; 0 for none
+ */
+static void
+far_prefetch(off_t  offset,
+             size_t size,
+             size_t owner)
+{
+  far_io_t *io;
+  size_t   limit;
+
+  if(size == 0)
+    return;
+
+  far_stat_add(FAR_STAT_PREFETCH, 1);
+  far_stat_add(FAR_STAT_PREFETCH_BYTES, size);
+
+  /* with backend=direct this loads the block cache; never more than half
+   * of it or of the budget, so prefetching cannot flush it
+   */
+  if(far_direct)
+  {
+    limit = far_cache.capacity * FAR_BLOCK_SIZE;
+    if(far_mem_budget() != 0 && far_mem_budget() < limit)
+      limit = far_mem_budget();
+    if(size > limit / 2)
+      size = limit / 2;
+  }
+
+  pthread_mutex_lock(&far_io.lock);
+  if(far_io.nthreads == 0)
+  {
+    pthread_mutex_unlock(&far_io.lock);
+    far_prefetch_run(offset, size);
+    return;
+  }
+
+  if(far_io.queued_count[FAR_IO_PREFETCH] >= FAR_PREFETCH_QUEUE
+  || (io = (far_io_t*)calloc(1, sizeof(far_io_t))) == NULL)
+  {
+    pthread_mutex_unlock(&far_io.lock);
+    far_stat_add(FAR_STAT_PREFETCH_DROP, 1);
+    return;
+  }
+
+  io->cls    = FAR_IO_PREFETCH;
+  io->offset = offset;
+  io->size   = size;
+  io->owner  = owner;
+  *far_io.tail[FAR_IO_PREFETCH] = io;
+  far_io.tail[FAR_IO_PREFETCH]  = &io->next;
+  far_io.queued_count[FAR_IO_PREFETCH] += 1;
+  pthread_cond_signal(&far_io.queued);
+  pthread_mutex_unlock(&far_io.lock);
+}
+
+/*! Wait until the prefetch queue has room
+ *
+ *  For background threads that would rather wait than have their
+ *  prefetches dropped.
+ */
+static void
+far_prefetch_wait(void)
+{
+  pthread_mutex_lock(&far_io.lock);
+  while(far_io.nthreads != 0 && !far_io.stop
+     && far_io.queued_count[FAR_IO_PREFETCH] >= FAR_PREFETCH_QUEUE)
+    pthread_cond_wait(&far_io.room, &far_io.lock);
+  pthread_mutex_unlock(&far_io.lock);
+}
+
+/*! Prefetch part of a file in the background
+ *
+ *  A chunked file's pieces are prefetched where they are stored, merging
+ *  pieces that happen to be stored back to back.
+ *
+ *  @param[in] entry  File
+ *  @param[in] offset Offset into the file
+ *  @param[in] size   Number of bytes, within the file
+ *  @param[in] owner  Slot + 1 of the file whose release cancels the
+ *                    prefetch; 0 for none
+ */
+static void
+far_prefetch_file(const FARentry_t *entry,
+                  size_t           offset,
+                  size_t           size,
+                  size_t           owner)
+{
+  size_t done, len, runsize = 0;
+  off_t  pos, run = 0;
+
+  /* an inline file was brought in with the metadata */
+  if(le32_to_cpu(entry->flags) & FAR_ENTRY_INLINE)
+    return;
+
+  /* the whole frame is needed for any part of a compressed file */
+  if(le32_to_cpu(entry->flags) & (FAR_ENTRY_ZSTD|FAR_ENTRY_SOLID))
+  {
+    len = far_stored(entry, &pos);
+    far_prefetch(pos, len, owner);
+    return;
+  }
+
+  for(done = 0; done < size; done += len)
+  {
+    len = far_extent(entry, offset + done, &pos);
+    if(len > size - done)
+      len = size - done;
+
+    if(runsize != 0 && run + (off_t)runsize == pos)
+    {
+      runsize += len;
+      continue;
+    }
+
+    far_prefetch(run, runsize, owner);
+    run     = pos;
+    runsize = len;
+  }
+
+  far_prefetch(run, runsize, owner);
+}
+
+/*! Write out and forget the pending record
+ *
+ *  Must be called with far_record_lock held.
+ */
+static void
+far_record_flush(void)
+{
+  if(far_record_last.size != 0)
+    fprintf(far_record_fp, "%zu %lld %zu\n", far_record_last.slot,
+            (long long)far_record_last.offset, far_record_last.size);
+  far_record_last.size = 0;
+}
+
+/*! Stop recording the startup read profile
+ *
+ *  Must be called with far_record_lock held.
+ */
+static void
+far_record_close(void)
+{
+  if(far_record_fp == NULL)
+    return;
+
+  /* replace the old profile only once the new one is complete */
+  far_record_flush();
+  if(fclose(far_record_fp) != 0 || rename(far_record_tmp, far_options.record) != 0)
+  {
+    perror(far_options.record);
+    unlink(far_record_tmp);
+  }
+  __atomic_store_n(&far_record_fp, NULL, __ATOMIC_RELAXED);
+}
+
+/*! Add a read to the startup read profile
+ *
+ *  Reads that continue where the previous one left off are merged, so that
+ *  kernel readahead of one file is recorded as a single range.
+ *
+ *  @param[in] slot   Slot of file read
+ *  @param[in] offset Offset into file
+ *  @param[in] size   Bytes read
+ */
+static void
+far_record(size_t slot,
+           off_t  offset,
+           size_t size)
+{
+  struct timespec now;
+
+  /* cheap check for the common case of not recording */
+  if(__atomic_load_n(&far_record_fp, __ATOMIC_RELAXED) == NULL || size == 0)
+    return;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  pthread_mutex_lock(&far_record_lock);
+  if(far_record_fp == NULL)
+    ;
+  else if(now.tv_sec > far_record_end.tv_sec
+       || (now.tv_sec == far_record_end.tv_sec && now.tv_nsec >= far_record_end.tv_nsec))
+    far_record_close();
+  else if(far_record_last.size != 0 && far_record_last.slot == slot
+       && far_record_last.offset + far_record_last.size == offset)
+    far_record_last.size += size;
+  else
+  {
+    far_record_flush();
+    far_record_last.slot   = slot;
+    far_record_last.offset = offset;
+    far_record_last.size   = size;
+  }
+  pthread_mutex_unlock(&far_record_lock);
+}
+
+/*! Prefetch a startup read profile
+ *
+ *  Issues a prefetch for every recorded range in order. Ranges that do not
+ *  fit the archive (e.g. the profile was recorded against another version)
+ *  are clamped or skipped.
+ *
+ *  @param[in] arg Unused
+ *
+ *  @returns NULL
+ */
+static void*
+far_replay(void *arg)
+{
+  const FARentry_t *entry;
+  size_t           slot, size, nslots = le32_to_cpu(header->nentries) + 1;
+  long long        offset;
+
+  while(!__atomic_load_n(&far_replay_stop, __ATOMIC_RELAXED)
+     && fscanf(far_replay_fp, "%zu %lld %zu", &slot, &offset, &size) == 3)
+  {
+    if(slot == 0 || slot >= nslots || offset < 0)
+      continue;
+
+    entry = far_slot_entry(slot);
+    if(far_type(entry) != FAR_FILE_TYPE || offset >= far_datasize(entry))
+      continue;
+
+    if(size > far_datasize(entry) - offset)
+      size = far_datasize(entry) - offset;
+
+    far_prefetch_wait();
+    far_prefetch_file(entry, offset, size, 0);
+  }
+
+  return NULL;
+}
+
+/*! Prefetch the file data of a directory
+ *
+ *  Covers the span from the first to the end of the last file's data, up
+ *  to the dir_prefetch budget. mkfar stores a directory's files back to
+ *  back, so the span is usually exactly the files' data. Chunked files are
+ *  stored elsewhere, so they are prefetched one by one with what is left
+ *  of the budget.
+ *
+ *  Archivers list a directory and close it before opening its files, so
+ *  closing the directory does not cancel this; the span is only dropped to
+ *  stay within the memory budget, and a chunked file's prefetch belongs to
+ *  that file.
+ *
+ *  @param[in] dir Directory whose files to prefetch
+ */
+static void
+far_prefetch_dir(const FARentry_t *dir)
+{
+  const FARentry_t *child = far_children(dir);
+  size_t           i, start = SIZE_MAX, end = 0, budget, size;
+  off_t            pos;
+
+  for(i = 0; i < far_datasize(dir); ++i, ++child)
+  {
+    if(far_type(child) != FAR_FILE_TYPE || far_datasize(child) == 0
+    || (le32_to_cpu(child->flags) & (FAR_ENTRY_CHUNKED|FAR_ENTRY_INLINE)))
+      continue;
+
+    size = far_stored(child, &pos);
+    if((size_t)pos < start)
+      start = pos;
+    if(pos + size > end)
+      end = pos + size;
+  }
+
+  budget = far_options.dir_prefetch;
+  if(start < end)
+  {
+    if(end - start > budget)
+      end = start + budget;
+
+    far_prefetch(start, end - start, 0);
+    budget -= end - start;
+  }
+
+  child = far_children(dir);
+  for(i = 0; i < far_datasize(dir) && budget != 0; ++i, ++child)
+  {
+    if(far_type(child) != FAR_FILE_TYPE
+    || !(le32_to_cpu(child->flags) & FAR_ENTRY_CHUNKED))
+      continue;
+
+    size = far_datasize(child) < budget ? far_datasize(child) : budget;
+    far_prefetch_file(child, 0, size, far_slot(child) + 1);
+    budget -= size;
+  }
+}
+
+/*! Prefetch ahead of files being opened in directory order
+ *
+ *  Remembers the last file opened in each directory. Opening the child
+ *  right after it suggests the directory is being walked in order, so the
+ *  next file is prefetched up to the seq_prefetch budget. Directories share
+ *  buckets by hash; a collision only costs a missed prediction. The
+ *  prefetch belongs to the next file, not the one being opened, which a
+ *  sequential reader closes before it gets there.
+ *
+ *  @param[in] entry File being opened
+ */
+static void
+far_prefetch_seq(const FARentry_t *entry)
+{
+  size_t           slot = far_inodes[far_slot(entry)].parent, index, i;
+  const FARentry_t *dir = far_slot_entry(slot), *next;
+  uint64_t         prev, *bucket;
+
+  index  = entry - far_children(dir);
+  bucket = &far_seq[far_mix64(slot) % FAR_SEQ_BUCKETS];
+  prev   = __atomic_exchange_n(bucket, (uint64_t)slot << 32 | (index + 1), __ATOMIC_RELAXED);
+  if(prev != ((uint64_t)slot << 32 | index) || index == 0)
+    return;
+
+  /* skip over subdirectories to the next file */
+  for(i = index + 1; i < far_datasize(dir); ++i)
+  {
+    next = far_children(dir) + i;
+    if(far_type(next) == FAR_FILE_TYPE)
+    {
+      far_prefetch_file(next, 0,
+                        far_datasize(next) < far_options.seq_prefetch
+                        ? far_datasize(next) : far_options.seq_prefetch,
+                        far_slot(next) + 1);
+      return;
+    }
+  }
+}
+
+/*! Get attributes
+ *
+ *  @param[in]  path Path to lookup
+ *  @param[out] st   Buffer to fill
+ *  @param[in]  fi   Open file information (may be NULL)
+ *
+ *  @returns 0 for success
+ *  @returns negated errno otherwise
+ */
+static int
+far_getattr(const char            *path,
+            struct stat           *st,
+            struct fuse_file_info *fi)
+{
+  const FARentry_t *parent, *entry;
+
+  far_stat_add(FAR_STAT_GETATTR, 1);
+
+  /* open files and directories keep their slot in the handle */
+  if(path == NULL)
+    entry = far_slot_entry(fi->fh);
+  else
+    entry = far_traverse_path(path, &parent);
+  if(entry == NULL)
+    return -ENOENT;
+
+  far_fill_stat(entry, st);
+  return 0;
+}
+
+/*! Read a directory
+ *
+ *  @param[in]  path   Directory to read
+ *  @param[out] buffer Buffer to fill
+ *  @param[in]  filler Callback which fills buffer
+ *  @param[in]  offset Directory offset
+ *  @param[in]  fi     Open directory information
+ *  @param[in]  flags  Readdir flags
+ *
+ *  @returns 0 for success
+ *  @returns negated errno otherwise
+ */
+static int
+far_readdir(const char               *path,
+            void                     *buffer,
+            fuse_fill_dir_t          filler,
+            off_t                    offset,
+            struct fuse_file_info    *fi,
+            enum fuse_readdir_flags  flags)
+{
+  struct stat              st;
+  off_t                    off;
+  enum fuse_fill_dir_flags fill = 0;
+  const char               *name;
+  char                     buf[FAR_NAME_MAX+1];
+  size_t                   len;
+
+  /* we set up this slot in far_opendir */
+  const FARentry_t *dir = far_slot_entry(fi->fh);
+  const FARentry_t *child;
+
+  far_stat_add(FAR_STAT_READDIR, 1);
+
+  /* the stat we hand back is complete, so it can seed the kernel caches */
+  if(flags & FUSE_READDIR_PLUS)
+    fill = FUSE_FILL_DIR_PLUS;
+
+  /* offset 0 means '.' */
+  if(offset == 0)
+  {
+    far_fill_stat(dir, &st);
+    if(filler(buffer, ".", &st, ++offset, fill))
+      return 0;
+  }
+
+  /* offset 1 means '..' */
+  if(offset == 1)
+  {
+    far_fill_stat(far_parent(dir), &st);
+    if(filler(buffer, "..", &st, ++offset, fill))
+      return 0;
+  }
+
+  /* start filling from the desired offset */
+  for(off = offset; off-2 < far_datasize(dir); ++off)
+  {
+    child = far_children(dir) + (off - 2);
+    if(off == offset)
+      name = far_name(child, buf, &len);
+    else
+      name = far_name_next(child, buf, &len);
+
+    far_fill_stat(child, &st);
+    if(filler(buffer, name, &st, off+1, fill))
+      return 0;
+  }
+
+  return 0;
+}
+
+/*! Open a file
+ *
+ *  @param[in]  path File to open
+ *  @param[out] fi   Open file information
+ *
+ *  @returns 0 for success
+ *  @returns negated errno otherwise
+ */
+static int
+far_open(const char            *path,
+         struct fuse_file_info *fi)
+{
+  const FARentry_t *parent, *entry;
+
+  far_stat_add(FAR_STAT_OPEN, 1);
+
+  /* lookup the path */
+  entry = far_traverse_path(path, &parent);
+  if(entry == NULL)
+  {
+    /* we didn't find it. if O_CREAT was specified, return EROFS */
+    if(fi->flags & O_CREAT)
+      return -EROFS;
+    /* otherwise, return ENOENT */
+    return -ENOENT;
+  }
+
+  /* don't allow write mode */
+  if((fi->flags & O_ACCMODE) == O_RDWR)
+    return -EACCES;
+  if((fi->flags & O_ACCMODE) == O_WRONLY)
+    return -EACCES;
+
+  /* remember the found entry's slot in the open file info */
+  fi->fh = far_slot(entry);
+
+  if(far_options.seq_prefetch != 0 && far_type(entry) == FAR_FILE_TYPE)
+    far_prefetch_seq(entry);
+
+  /* keep the kernel's cached data across opens if the archive is immutable */
+  fi->keep_cache = far_options.immutable;
+
+  return 0;
+}
+
+/*! Release an open file
+ *
+ *  Cancels what is left of the prefetches that belong to it. Handles to the
+ *  same file share a slot, so this cancels theirs as well.
+ *
+ *  @param[in] path Path of file (unused)
+ *  @param[in] fi   Open file information
+ *
+ *  @returns 0
+ */
+static int
+far_release(const char            *path,
+            struct fuse_file_info *fi)
+{
+  far_io_cancel(fi->fh);
+
+  return 0;
+}
+
+/*! Read a file
+ *
+ *  @param[in]  path   Path of open file
+ *  @param[out] buffer Buffer to fill
+ *  @param[in]  size   Size to fill
+ *  @param[in]  offset Offset to start at
+ *
+ *  @returns number of bytes read
+ *  @returns negated errno otherwise
+ */
+static int
+far_read(const char            *path,
+         char                  *buffer,
+         size_t                size,
+         off_t                 offset,
+         struct fuse_file_info *fi)
+{
+  const FARentry_t *entry = far_slot_entry(fi->fh);
+
+  if(offset < 0)
+    return -EINVAL;
+
+  /* past end-of-file; return 0 bytes read */
+  if(offset >= far_datasize(entry))
+    return 0;
+
+  /* if they want to read past end-of-file, truncate the amount to read */
+  if(offset + size > far_datasize(entry))
+    size = far_datasize(entry) - offset;
+
+  far_record(fi->fh, offset, size);
+
+  return far_read_file(entry, offset, buffer, size);
+}
+
+/*! Read a file into a buffer vector
+ *
+ *  The returned buffer refers to the archive file descriptor, so libfuse can
+ *  splice the data from the page cache straight into /dev/fuse when the
+ *  kernel supports it, and falls back to reading it otherwise.
+ *
+ *  @param[in]  path   Path of open file
+ *  @param[out] bufp   Buffer vector to fill
+ *  @param[in]  size   Size to fill
+ *  @param[in]  offset Offset to start at
+ *  @param[in]  fi     Open file information
+ *
+ *  @returns 0 for success
+ *  @returns negated errno otherwise
+ */
+static int
+far_read_buf(const char            *path,
+             struct fuse_bufvec    **bufp,
+             size_t                size,
+             off_t                 offset,
+             struct fuse_file_info *fi)
+{
+  const FARentry_t   *entry = far_slot_entry(fi->fh);
+  struct fuse_bufvec *buf;
+  ssize_t            rc;
+  size_t             i, n, len, done;
+  off_t              pos;
+  int                resident = !far_direct
+                              && !(le32_to_cpu(entry->flags)
+                                   & (FAR_ENTRY_ZSTD|FAR_ENTRY_SOLID|FAR_ENTRY_INLINE));
+
+  if(offset < 0)
+    return -EINVAL;
+
+  /* past end-of-file; read 0 bytes */
+  if(offset >= far_datasize(entry))
+    size = 0;
+  /* if they want to read past end-of-file, truncate the amount to read */
+  else if(offset + size > far_datasize(entry))
+    size = far_datasize(entry) - offset;
+
+  far_stat_add(FAR_STAT_READ, 1);
+  far_stat_add(FAR_STAT_READ_BYTES, size);
+  far_record(fi->fh, offset, size);
+
+  /* count the pieces of the file the range covers; compressed and inline
+   * data always has to be copied
+   */
+  for(n = 0, done = 0; resident && done < size; ++n, done += len)
+  {
+    len = far_extent(entry, offset + done, &pos);
+    if(len > size - done)
+      len = size - done;
+    resident = resident && far_resident(pos, len);
+  }
+
+  /* point one buffer at each piece of file data inside the archive; libfuse
+   * splices them in this thread, which only stays quick if the data is
+   * resident
+   */
+  if(resident)
+  {
+    buf = (struct fuse_bufvec*)malloc(sizeof(struct fuse_bufvec)
+                                      + (n > 1 ? n - 1 : 0) * sizeof(struct fuse_buf));
+    if(buf == NULL)
+      return -ENOMEM;
+
+    *buf = FUSE_BUFVEC_INIT(size);
+    for(i = 0, done = 0; i < n; ++i, done += len)
+    {
+      len = far_extent(entry, offset + done, &pos);
+      if(len > size - done)
+        len = size - done;
+
+      buf->buf[i]       = buf->buf[0];
+      buf->buf[i].size  = len;
+      buf->buf[i].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+      buf->buf[i].fd    = far_fd;
+      buf->buf[i].pos   = pos;
+    }
+    if(n != 0)
+      buf->count = n;
+
+    *bufp = buf;
+    return 0;
+  }
+
+  /* otherwise hand libfuse a copy it will free; the block cache's memory
+   * may go away once we return, and cold data comes from the I/O pool
+   */
+  buf = (struct fuse_bufvec*)malloc(sizeof(struct fuse_bufvec));
+  if(buf == NULL)
+    return -ENOMEM;
+
+  *buf = FUSE_BUFVEC_INIT(size);
+  buf->buf[0].mem = malloc(size ? size : 1);
+  if(buf->buf[0].mem == NULL)
+  {
+    free(buf);
+    return -ENOMEM;
+  }
+
+  rc = far_read_file(entry, offset, (char*)buf->buf[0].mem, size);
+  if(rc < 0)
+  {
+    free(buf->buf[0].mem);
+    free(buf);
+    return rc;
+  }
+  buf->buf[0].size = rc;
+
+  *bufp = buf;
+  return 0;
+}
+
+/*! Open a directory
+ *
+ *  @param[in]  path Path to open
+ *  @param[out] fi   Open directory information
+ *
+ *  @returns 0 for success
+ *  @returns negated errno otherwise
+ */
+static int
+far_opendir(const char            *path,
+            struct fuse_file_info *fi)
+{
+  const FARentry_t *parent, *entry;
+
+  far_stat_add(FAR_STAT_OPENDIR, 1);
+
+  /* lookup the path */
+  entry = far_traverse_path(path, &parent);
+  if(entry == NULL)
+    return -ENOENT;
+
+  /* make sure this is a directory */
+  if(far_type(entry) != FAR_DIR_TYPE)
+    return -ENOTDIR;
+
+  /* remember the found entry's slot in the open directory info; '..'
+   * comes from the inode table, so there is nothing to allocate or release
+   */
+  fi->fh = far_slot(entry);
+
+  /* loaders tend to read every file of a directory they open */
+  if(far_options.dir_prefetch != 0)
+    far_prefetch_dir(entry);
+
+  /* let the kernel cache the listing; keep it across opens if immutable */
+  fi->cache_readdir = 1;
+  fi->keep_cache    = far_options.immutable;
+
+  return 0;
+}
+
+/*! Format the mem_limit attribute
+ *
+ *  @param[in]  entry Unused
+ *  @param[out] buf   Buffer of FAR_XATTR_MAX bytes
+ *
+ *  @returns length of value
+ */
+static int
+far_xattr_get_mem_limit(const FARentry_t *entry,
+                        char             *buf)
+{
+  return snprintf(buf, FAR_XATTR_MAX, "%" PRIu64,
+                  __atomic_load_n(&far_mem_limit, __ATOMIC_RELAXED));
+}
+
+/*! Change the memory budget
+ *
+ *  @param[in] value New budget in bytes; 0 for no limit
+ *
+ *  @returns 0 for success
+ *  @returns negated errno otherwise
+ */
+static int
+far_xattr_set_mem_limit(const char *value)
+{
+  unsigned long long limit;
+  char               *end;
+
+  errno = 0;
+  limit = strtoull(value, &end, 10);
+  if(errno != 0 || end == value || *end != '\0')
+    return -EINVAL;
+
+  __atomic_store_n(&far_mem_limit, limit, __ATOMIC_RELAXED);
+  far_governor_enforce();
+  return 0;
+}
+
+/*! Format the mem_budget attribute
+ *
+ *  @param[in]  entry Unused
+ *  @param[out] buf   Buffer of FAR_XATTR_MAX bytes
+ *
+ *  @returns length of value
+ */
+static int
+far_xattr_get_mem_budget(const FARentry_t *entry,
+                         char             *buf)
+{
+  return snprintf(buf, FAR_XATTR_MAX, "%zu", far_mem_budget());
+}
+
+/*! Format the mem_usage attribute
+ *
+ *  @param[in]  entry Unused
+ *  @param[out] buf   Buffer of FAR_XATTR_MAX bytes
+ *
+ *  @returns length of value
+ */
+static int
+far_xattr_get_mem_usage(const FARentry_t *entry,
+                        char             *buf)
+{
+  return snprintf(buf, FAR_XATTR_MAX, "%zu", far_mem_usage());
+}
+
+/*! Format the stats attribute
+ *
+ *  One "name: value" line per counter, as printed on unmount; a daemon's
+ *  stderr usually goes nowhere, so this is how a mount is inspected.
+ *
+ *  @param[in]  entry Unused
+ *  @param[out] buf   Buffer of FAR_XATTR_MAX bytes
+ *
+ *  @returns length of value
+ */
+static int
+far_xattr_get_stats(const FARentry_t *entry,
+                    char             *buf)
+{
+  far_stat_t stat;
+  int        len = 0;
+
+  for(stat = 0; stat < FAR_STAT_MAX && len < FAR_XATTR_MAX; ++stat)
+    len += snprintf(buf + len, FAR_XATTR_MAX - len, "%s: %" PRIu64 "\n", far_stat_names[stat],
+                    __atomic_load_n(&far_stats[stat], __ATOMIC_RELAXED));
+
+  return len < FAR_XATTR_MAX ? len : FAR_XATTR_MAX - 1;
+}
+
+/*! Format the rsize attribute
+ *
+ *  @param[in]  entry Directory
+ *  @param[out] buf   Buffer of FAR_XATTR_MAX bytes
+ *
+ *  @returns length of value
+ */
+static int
+far_xattr_get_rsize(const FARentry_t *entry,
+                    char             *buf)
+{
+  return snprintf(buf, FAR_XATTR_MAX, "%" PRIu64, far_total(entry)->size);
+}
+
+/*! Format the rfiles attribute
+ *
+ *  @param[in]  entry Directory
+ *  @param[out] buf   Buffer of FAR_XATTR_MAX bytes
+ *
+ *  @returns length of value
+ */
+static int
+far_xattr_get_rfiles(const FARentry_t *entry,
+                     char             *buf)
+{
+  return snprintf(buf, FAR_XATTR_MAX, "%" PRIu32, far_total(entry)->files);
+}
+
+/*! Format the rdirs attribute
+ *
+ *  @param[in]  entry Directory
+ *  @param[out] buf   Buffer of FAR_XATTR_MAX bytes
+ *
+ *  @returns length of value
+ */
+static int
+far_xattr_get_rdirs(const FARentry_t *entry,
+                    char             *buf)
+{
+  return snprintf(buf, FAR_XATTR_MAX, "%" PRIu32, far_total(entry)->dirs);
+}
+
+/*! Extended attribute */
+typedef struct far_xattr_t
+{
+  const char *name;      /*!< attribute name */
+  int        root_only;  /*!< only present on the root directory */
+  int        dir_only;   /*!< only present on directories */
+  int        (*get)(const FARentry_t*, char*); /*!< format the value */
+  int        (*set)(const char*);              /*!< apply a new value (NULL: read-only) */
+} far_xattr_t;
+
+/*! Extended attributes; the root directory's are the control interface,
+ *  and every directory reports the totals of the tree below it
+ */
+static const far_xattr_t far_xattrs[] =
+{
+  { FAR_XATTR_PREFIX "mem_limit",  1, 1, far_xattr_get_mem_limit,  far_xattr_set_mem_limit, },
+  { FAR_XATTR_PREFIX "mem_budget", 1, 1, far_xattr_get_mem_budget, NULL,                    },
+  { FAR_XATTR_PREFIX "mem_usage",  1, 1, far_xattr_get_mem_usage,  NULL,                    },
+  { FAR_XATTR_PREFIX "stats",      1, 1, far_xattr_get_stats,      NULL,                    },
+  { FAR_XATTR_PREFIX "rsize",      0, 1, far_xattr_get_rsize,      NULL,                    },
+  { FAR_XATTR_PREFIX "rfiles",     0, 1, far_xattr_get_rfiles,     NULL,                    },
+  { FAR_XATTR_PREFIX "rdirs",      0, 1, far_xattr_get_rdirs,      NULL,                    },
+};
+
+/*! Check whether an entry has an extended attribute
+ *
+ *  @param[in] entry Entry
+ *  @param[in] xattr Attribute
+ *
+ *  @returns whether entry has xattr
+ */
+static int
+far_xattr_has(const FARentry_t  *entry,
+              const far_xattr_t *xattr)
+{
+  return (!xattr->root_only || entry == root)
+      && (!xattr->dir_only || far_type(entry) == FAR_DIR_TYPE);
+}
+
+/*! Number of extended attributes */
+#define FAR_NUM_XATTRS (sizeof(far_xattrs) / sizeof(far_xattrs[0]))
+
+/*! Find an extended attribute of an entry
+ *
+ *  @param[in] entry Entry
+ *  @param[in] name  Attribute name
+ *
+ *  @returns attribute
+ *  @returns NULL if the entry has no such attribute
+ */
+static const far_xattr_t*
+far_xattr_find(const FARentry_t *entry,
+               const char       *name)
+{
+  size_t i;
+
+  for(i = 0; i < FAR_NUM_XATTRS; ++i)
+  {
+    if(far_xattr_has(entry, far_xattrs + i) && strcmp(far_xattrs[i].name, name) == 0)
+      return far_xattrs + i;
+  }
+
+  return NULL;
+}
+
+/*! Get an extended attribute
+ *
+ *  @param[in]  path  Path to lookup
+ *  @param[in]  name  Attribute name
+ *  @param[out] value Buffer to fill
+ *  @param[in]  size  Size of buffer; 0 to query the size
+ *
+ *  @returns length of value
+ *  @returns negated errno otherwise
+ */
+static int
+far_getxattr(const char *path,
+             const char *name,
+             char       *value,
+             size_t     size)
+{
+  const FARentry_t  *parent, *entry;
+  const far_xattr_t *xattr;
+  char              buf[FAR_XATTR_MAX];
+  int               len;
+
+  /* most queries are for security.* and friends; skip the lookup */
+  if(strncmp(name, FAR_XATTR_PREFIX, sizeof(FAR_XATTR_PREFIX) - 1) != 0)
+    return -ENODATA;
+
+  entry = far_traverse_path(path, &parent);
+  if(entry == NULL)
+    return -ENOENT;
+
+  xattr = far_xattr_find(entry, name);
+  if(xattr == NULL)
+    return -ENODATA;
+
+  len = xattr->get(entry, buf);
+  if(size == 0)
+    return len;
+  if(size < len)
+    return -ERANGE;
+
+  memcpy(value, buf, len);
+  return len;
+}
+
+/*! List extended attributes
+ *
+ *  @param[in]  path Path to lookup
+ *  @param[out] list Buffer to fill with NUL-terminated names
+ *  @param[in]  size Size of buffer; 0 to query the size
+ *
+ *  @returns length of list
+ *  @returns negated errno otherwise
+ */
+static int
+far_listxattr(const char *path,
+              char       *list,
+              size_t     size)
+{
+  const FARentry_t *parent, *entry;
+  size_t           i, len, total = 0;
+
+  entry = far_traverse_path(path, &parent);
+  if(entry == NULL)
+    return -ENOENT;
+
+  for(i = 0; i < FAR_NUM_XATTRS; ++i)
+  {
+    if(!far_xattr_has(entry, far_xattrs + i))
+      continue;
+
+    len = strlen(far_xattrs[i].name) + 1;
+    if(size != 0 && total + len > size)
+      return -ERANGE;
+    if(size != 0)
+      memcpy(list + total, far_xattrs[i].name, len);
+    total += len;
+  }
+
+  return total;
+}
+
+/*! Set an extended attribute
+ *
+ *  The archive is read-only; only the control attributes of the root
+ *  directory can be set, and only by the user who mounted it or root.
+ *
+ *  @param[in] path  Path to lookup
+ *  @param[in] name  Attribute name
+ *  @param[in] value New value (not NUL-terminated)
+ *  @param[in] size  Length of value
+ *  @param[in] flags XATTR_CREATE or XATTR_REPLACE (ignored)
+ *
+ *  @returns 0 for success
+ *  @returns negated errno otherwise
+ */
+static int
+far_setxattr(const char *path,
+             const char *name,
+             const char *value,
+             size_t     size,
+             int        flags)
+{
+  const FARentry_t  *parent, *entry;
+  const far_xattr_t *xattr;
+  char              buf[FAR_XATTR_MAX];
+
+  entry = far_traverse_path(path, &parent);
+  if(entry == NULL)
+    return -ENOENT;
+
+  xattr = far_xattr_find(entry, name);
+  if(xattr == NULL || xattr->set == NULL)
+    return -EROFS;
+
+  if(fuse_get_context()->uid != 0 && fuse_get_context()->uid != getuid())
+    return -EPERM;
+
+  if(size >= sizeof(buf))
+    return -EINVAL;
+  memcpy(buf, value, size);
+  buf[size] = '\0';
+
+  return xattr->set(buf);
+}
+
+/*! Initialize filesystem
+ *
+ *  @param[in] conn Connection information
+ *  @param[in] cfg  Filesystem configuration
+ *
+ *  @returns private data (unused)
+ */
+static void*
+far_init(struct fuse_conn_info *conn,
+         struct fuse_config    *cfg)
+{
+  /* we never need a path for operations on an open handle */
+  cfg->nullpath_ok = 1;
+
+  /* report our own inode numbers */
+  cfg->use_ino = 1;
+
+  /* splice file data from the archive's page cache; we have no use for
+   * FUSE_CAP_SPLICE_READ since we never accept write data
+   */
+  conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE|FUSE_CAP_SPLICE_MOVE);
+
+  /* hand out attributes along with directory listings */
+  conn->want |= conn->capable & FUSE_CAP_READDIRPLUS;
+
+  /* libfuse derives max_pages from max_write, and it bounds reads as well */
+  conn->max_write     = FAR_MAX_REQUEST;
+  conn->max_readahead = FAR_MAX_REQUEST;
+
+  /* the tree cannot change under a mount, so misses can be cached unless
+   * told otherwise
+   */
+  if(!far_options.negative_timeout)
+    cfg->negative_timeout = FAR_NEGATIVE_TIMEOUT;
+
+  if(far_options.immutable)
+  {
+    /* nothing changes until the archive is remounted, so the kernel may
+     * hold on to dentries, attributes and misses for as long as it likes
+     */
+    cfg->entry_timeout    = FAR_IMMUTABLE_TIMEOUT;
+    cfg->attr_timeout     = FAR_IMMUTABLE_TIMEOUT;
+    cfg->negative_timeout = FAR_IMMUTABLE_TIMEOUT;
+
+    /* there is no point revalidating cached data against our mtime */
+    conn->want &= ~FUSE_CAP_AUTO_INVAL_DATA;
+  }
+
+  /* the startup window starts now that the mount is up */
+  if(far_record_fp != NULL)
+  {
+    clock_gettime(CLOCK_MONOTONIC, &far_record_end);
+    far_record_end.tv_sec += far_options.record_time;
+  }
+
+  /* read cold data from the I/O pool, and keep the kernel from sending
+   * more background reads than it has threads, so there are always FUSE
+   * workers left for everything else; threads do not survive daemonizing,
+   * so none of them can be started any earlier
+   */
+  far_io_start();
+  if(far_io.nthreads != 0)
+  {
+    conn->max_background        = far_io.nthreads;
+    conn->congestion_threshold  = (far_io.nthreads * 3 + 3) / 4;
+  }
+
+  /* get ahead of the application */
+  if(far_replay_fp != NULL
+  && pthread_create(&far_replay_thread, NULL, far_replay, NULL) != 0)
+  {
+    fclose(far_replay_fp);
+    far_replay_fp = NULL;
+  }
+
+  /* shrink the budget when the host or our cgroup runs short of memory;
+   * mem_limit can be set later through the root directory, so watch even
+   * without one
+   */
+  if((far_psi_fd = far_psi_open()) >= 0
+  && pthread_create(&far_governor_thread, NULL, far_governor, NULL) != 0)
+  {
+    close(far_psi_fd);
+    far_psi_fd = -1;
+  }
+
+  return NULL;
+}
+
+/*! Clean up filesystem
+ *
+ *  @param[in] private_data Private data (unused)
+ */
+static void
+far_destroy(void *private_data)
+{
+  far_stat_t stat;
+
+  pthread_mutex_lock(&far_record_lock);
+  far_record_close();
+  pthread_mutex_unlock(&far_record_lock);
+
+  if(far_replay_fp != NULL)
+  {
+    __atomic_store_n(&far_replay_stop, 1, __ATOMIC_RELAXED);
+    pthread_join(far_replay_thread, NULL);
+    fclose(far_replay_fp);
+    far_replay_fp = NULL;
+  }
+
+  if(far_psi_fd >= 0)
+  {
+    __atomic_store_n(&far_governor_stop, 1, __ATOMIC_RELAXED);
+    pthread_join(far_governor_thread, NULL);
+    close(far_psi_fd);
+    far_psi_fd = -1;
+  }
+
+  far_io_stop();
+
+  if(!far_options.stats)
+    return;
+
+  for(stat = 0; stat < FAR_STAT_MAX; ++stat)
+    fprintf(stderr, "%s: %" PRIu64 "\n", far_stat_names[stat], far_stats[stat]);
+}
+
+/*! FARFS FUSE operations */
+static const struct fuse_operations far_ops =
+{
+  .init       = far_init,
+  .destroy    = far_destroy,
+  .getattr    = far_getattr,
+  .open       = far_open,
+  .opendir    = far_opendir,
+  .release    = far_release,
+  .read       = far_read,
+  .read_buf   = far_read_buf,
+  .readdir    = far_readdir,
+  .getxattr   = far_getxattr,
+  .listxattr  = far_listxattr,
+  .setxattr   = far_setxattr,
+};
+
+/*! fuse_opt_parse callback
+ *
+ *  @param[in]  data    Unused
+ *  @param[in]  arg     Current argument
+ *  @param[in]  key     Argument key
+ *  @param[out] outargs Unused
+ *
+ *  @returns 0 for success and discard
+ *  @returns 1 for success and keep
+ *  @returns -1 for failure
+ */
+static int
+far_process_arg(void             *data,
+                  const char       *arg,
+                  int              key,
+                  struct fuse_args *outargs)
+{
+  if(key == FUSE_OPT_KEY_NONOPT)
+  {
+    if(far_file == NULL)
+    {
+      /* discard first non-option, which is the far filename */
+      far_file = arg;
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/*! Parse the version-specific part of the header
+ *
+ *  @param[in] size Size of the archive
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+far_parse_header(size_t size)
+{
+  const FARheader1_t *header1 = (const FARheader1_t*)header;
+  const FARsection_t *section;
+  uint32_t           i, offset, nsections, nbuckets, nslots;
+
+  switch(le32_to_cpu(header->version))
+  {
+    case FAR_VERSION_0:
+      if((size - sizeof(FARheader_t)) / sizeof(FARentry_t) < le32_to_cpu(header->nentries))
+      {
+        fprintf(stderr, "Truncated entry table\n");
+        return -1;
+      }
+      far_entries = (const FARentry_t*)(header + 1);
+      return 0;
+
+    case FAR_VERSION_1:
+      break;
+
+    default:
+      fprintf(stderr, "Invalid version %#x\n", le32_to_cpu(header->version));
+      return -1;
+  }
+
+  nsections = le32_to_cpu(header1->nsections);
+  if(size < sizeof(FARheader1_t)
+  || (size - sizeof(FARheader1_t)) / sizeof(FARsection_t) < nsections)
+  {
+    fprintf(stderr, "Truncated header\n");
+    return -1;
+  }
+
+  offset = le32_to_cpu(header1->entryoff);
+  if(offset > size || (size - offset) / sizeof(FARentry_t) < le32_to_cpu(header->nentries))
+  {
+    fprintf(stderr, "Invalid entry table offset %#x\n", offset);
+    return -1;
+  }
+  far_entries        = (const FARentry_t*)((const char*)far_mapping + offset);
+  dummy_root.dataoff = header1->entryoff;
+  far_flags          = le32_to_cpu(header1->flags);
+
+  for(i = 0; i < nsections; ++i)
+  {
+    section = header1->sections + i;
+    offset  = le32_to_cpu(section->offset);
+    if(offset > size || size - offset < le32_to_cpu(section->size))
+    {
+      fprintf(stderr, "Invalid section offset %#x\n", offset);
+      return -1;
+    }
+
+    switch(le32_to_cpu(section->type))
+    {
+      case FAR_SECTION_PHASH:
+        far_phash = (const FARphash_t*)((const char*)far_mapping + offset);
+        nbuckets  = le32_to_cpu(far_phash->nbuckets);
+        nslots    = le32_to_cpu(far_phash->nslots);
+        if(le32_to_cpu(section->size) < sizeof(FARphash_t)
+        || nbuckets == 0 || nslots == 0 || nslots != le32_to_cpu(header->nentries)
+        || (le32_to_cpu(section->size) - sizeof(FARphash_t)) / sizeof(uint32_t) < nbuckets
+        || (le32_to_cpu(section->size) - sizeof(FARphash_t) - nbuckets * sizeof(uint32_t))
+             / sizeof(FARphslot_t) < nslots)
+        {
+          fprintf(stderr, "Invalid perfect hash section\n");
+          return -1;
+        }
+        break;
+
+      case FAR_SECTION_NAMEHASH:
+        if(le32_to_cpu(section->size) / sizeof(uint32_t) < le32_to_cpu(header->nentries))
+        {
+          fprintf(stderr, "Invalid name hash section\n");
+          return -1;
+        }
+        far_namehash = (const uint32_t*)((const char*)far_mapping + offset);
+        break;
+
+      case FAR_SECTION_CHUNKS:
+        far_chunks  = (const FARchunk_t*)((const char*)far_mapping + offset);
+        far_nchunks = le32_to_cpu(section->size) / sizeof(FARchunk_t);
+        break;
+
+      case FAR_SECTION_DICT:
+        far_dict     = (const char*)far_mapping + offset;
+        far_dictsize = le32_to_cpu(section->size);
+        break;
+
+      case FAR_SECTION_BLOCKS:
+        far_blocks  = (const FARblock_t*)((const char*)far_mapping + offset);
+        far_nblocks = le32_to_cpu(section->size) / sizeof(FARblock_t);
+        break;
+
+      default:
+        /* unknown sections are optional */
+        break;
+    }
+  }
+
+  return 0;
+}
+
+/*! Entry flag bits above far_type_t that this build understands */
+#define FAR_ENTRY_FLAGS (FAR_ENTRY_CHUNKED | FAR_ENTRY_ZSTD | FAR_ENTRY_SOLID \
+                         | FAR_ENTRY_INLINE)
+
+/*! Size of the archive */
+static size_t far_size = 0;
+
+/*! Check that a string in the archive is NUL-terminated
+ *
+ *  @param[in] offset Offset (from header) to string
+ *  @param[in] max    Longest allowed length
+ *
+ *  @returns length of string
+ *  @returns 0 if the string is empty, too long or runs off the archive
+ */
+static size_t
+far_valid_string(uint32_t offset,
+                 size_t   max)
+{
+  const char *str = (const char*)far_mapping + offset;
+  const char *nul;
+
+  if(offset >= far_size)
+    return 0;
+
+  if(max > far_size - offset - 1)
+    max = far_size - offset - 1;
+
+  nul = (const char*)memchr(str, '\0', max + 1);
+  if(nul == NULL)
+    return 0;
+
+  return nul - str;
+}
+
+/*! Validate a range of chunks
+ *
+ *  @param[in] begin First chunk
+ *  @param[in] end   One past the last chunk
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+far_validate_chunks(size_t begin,
+                    size_t end)
+{
+  size_t i;
+
+  for(i = begin; i < end; ++i)
+  {
+    if(le32_to_cpu(far_chunks[i].offset) > far_size
+    || far_size - le32_to_cpu(far_chunks[i].offset) < le32_to_cpu(far_chunks[i].size)
+    || le32_to_cpu(far_chunks[i].size) == 0)
+    {
+      fprintf(stderr, "Invalid chunk %zu\n", i);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/*! Validate a range of solid blocks
+ *
+ *  Blocks must follow each other in the solid stream, so that
+ *  far_solid_block can binary search them.
+ *
+ *  @param[in] begin First block
+ *  @param[in] end   One past the last block
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+far_validate_blocks(size_t begin,
+                    size_t end)
+{
+  size_t i;
+
+  for(i = begin; i < end; ++i)
+  {
+    if(le32_to_cpu(far_blocks[i].offset) > far_size
+    || far_size - le32_to_cpu(far_blocks[i].offset) < le32_to_cpu(far_blocks[i].size)
+    || le32_to_cpu(far_blocks[i].size) == 0
+    || le32_to_cpu(far_blocks[i].end) <= far_solid_start(i)
+    || le32_to_cpu(far_blocks[i].end) - far_solid_start(i) > FAR_SOLID_MAX)
+    {
+      fprintf(stderr, "Invalid solid block %zu\n", i);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/*! Check that a solid file lies within one solid block
+ *
+ *  @param[in] entry Solid file
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+far_valid_solid(const FARentry_t *entry)
+{
+  size_t pos = le32_to_cpu(entry->dataoff), block = far_solid_block(pos);
+
+  if(block >= far_nblocks
+  || le32_to_cpu(far_blocks[block].end) - pos < far_datasize(entry))
+    return -1;
+
+  return 0;
+}
+
+/*! Validate the chunk list of a chunked file
+ *
+ *  Every chunk must exist and the chunks must add up to the file exactly,
+ *  so that far_extent can trust the list.
+ *
+ *  @param[in] entry Chunked file
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+far_valid_chunklist(const FARentry_t *entry)
+{
+  const FARchunklist_t *list = (const FARchunklist_t*)far_data(entry);
+  size_t               i, count, chunk, end = 0;
+
+  if(le32_to_cpu(entry->dataoff) > far_size
+  || far_size - le32_to_cpu(entry->dataoff) < sizeof(FARchunklist_t))
+    return -1;
+
+  count = le32_to_cpu(list->count);
+  if((far_size - le32_to_cpu(entry->dataoff) - sizeof(FARchunklist_t))
+     / sizeof(FARchunkref_t) < count)
+    return -1;
+
+  for(i = 0; i < count; ++i)
+  {
+    chunk = le32_to_cpu(list->refs[i].chunk);
+    if(chunk >= far_nchunks
+    || le32_to_cpu(list->refs[i].end) - end != le32_to_cpu(far_chunks[chunk].size)
+    || le32_to_cpu(list->refs[i].end) <= end)
+      return -1;
+    end = le32_to_cpu(list->refs[i].end);
+  }
+
+  return end == far_datasize(entry) ? 0 : -1;
+}
+
+/*! Validate a range of entries on their own
+ *
+ *  Checks the type, flags, name and file data of every entry.
+ *
+ *  @param[in] begin First entry table index
+ *  @param[in] end   One past the last entry table index
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+far_validate_entries(size_t begin,
+                     size_t end)
+{
+  size_t           i, len = 0;
+  uint32_t         flags, nameoff;
+  const FARentry_t *entry;
+  const FARname_t  *rec;
+
+  for(i = begin; i < end; ++i)
+  {
+    entry   = far_entries + i;
+    flags   = le32_to_cpu(entry->flags);
+    nameoff = le32_to_cpu(entry->nameoff);
+
+    if((far_type(entry) != FAR_FILE_TYPE && far_type(entry) != FAR_DIR_TYPE)
+    || (flags & ~0xFF & ~FAR_ENTRY_FLAGS)
+    || ((flags & FAR_ENTRY_CHUNKED) && (far_type(entry) != FAR_FILE_TYPE || far_chunks == NULL))
+    || ((flags & FAR_ENTRY_ZSTD) && (far_type(entry) != FAR_FILE_TYPE || far_dict == NULL
+                                     || (flags & FAR_ENTRY_CHUNKED)))
+    || ((flags & FAR_ENTRY_SOLID) && (far_type(entry) != FAR_FILE_TYPE || far_blocks == NULL
+                                      || (flags & (FAR_ENTRY_CHUNKED|FAR_ENTRY_ZSTD))))
+    || ((flags & FAR_ENTRY_INLINE) && (far_type(entry) != FAR_FILE_TYPE
+                                       || (flags & (FAR_ENTRY_CHUNKED|FAR_ENTRY_ZSTD
+                                                    |FAR_ENTRY_SOLID)))))
+    {
+      fprintf(stderr, "Invalid flags %#x for entry %zu\n", flags, i);
+      return -1;
+    }
+
+    if(!(far_flags & FAR_HEADER_FRONTCODED))
+      len = far_valid_string(nameoff, FAR_NAME_MAX);
+    else if(nameoff < far_size && far_size - nameoff >= sizeof(FARname_t))
+    {
+      /* the record must fit and only reuse what the previous name had */
+      rec = (const FARname_t*)((const char*)far_mapping + nameoff);
+      if(far_size - nameoff - sizeof(FARname_t) < rec->length
+      || rec->prefix + rec->length > FAR_NAME_MAX
+      || rec->prefix > (i % FAR_NAME_RESTART == 0 ? 0 : len))
+        len = 0;
+      else
+        len = rec->prefix + rec->length;
+    }
+    else
+      len = 0;
+
+    if(len == 0)
+    {
+      fprintf(stderr, "Invalid name for entry %zu\n", i);
+      return -1;
+    }
+
+    /* a compressed record's frame is checked when it is read, so that
+     * mounting does not touch file data
+     */
+    if(far_type(entry) == FAR_FILE_TYPE
+    && ((flags & FAR_ENTRY_CHUNKED) ? far_valid_chunklist(entry) != 0
+        : (flags & FAR_ENTRY_SOLID) ? far_valid_solid(entry) != 0
+        : (le32_to_cpu(entry->dataoff) > far_size
+           || far_size - le32_to_cpu(entry->dataoff)
+              < ((flags & FAR_ENTRY_ZSTD) ? sizeof(FARzstd_t) : far_datasize(entry)))))
+    {
+      fprintf(stderr, "Invalid data for entry %zu\n", i);
+      return -1;
+    }
+  }
 
-  if(far_type(entry) == FAR_DIR_TYPE)
-    st->st_mode = FAR_DIR_MODE;
-  else
-    st->st_mode = FAR_FILE_MODE;
+  return 0;
 }
 
-/*! Traverse path to get entry
+/*! Validate a range of directories
  *
- *  @param[in] path Path to traverse
+ *  Checks that every directory's children lie in the entry table after the
+ *  directory itself and claims them, so that no entry has two parents.
+ *  Fills in the inode table along the way.
  *
- *  @returns entry that was found
- *  @returns NULL for no entry
+ *  @param[in] begin First slot
+ *  @param[in] end   One past the last slot
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
  */
-static const FARentry_t*
-far_traverse_path(const char       *path,
-                  const FARentry_t **parent)
+static int
+far_validate_dirs(size_t begin,
+                  size_t end)
 {
-  const char       *p, *name;
-  const FARentry_t *dir = root, *entry;
-  size_t           i, num_subdirs;
+  size_t           slot, i, first, nlink, nentries = le32_to_cpu(header->nentries);
+  size_t           base = (const char*)far_entries - (const char*)far_mapping;
+  uint32_t         unclaimed;
+  const FARentry_t *dir;
+  const FARname_t  *rec;
 
-  *parent = dir;
+  for(slot = begin; slot < end; ++slot)
+  {
+    far_inodes[slot].ino = slot;
 
-  /* special case; this is the root directory */
-  if(strcmp(path, "/") == 0)
-    return dir;
+    dir = far_slot_entry(slot);
+    if(far_type(dir) != FAR_DIR_TYPE)
+    {
+      far_inodes[slot].nlink = 1;
+      continue;
+    }
 
-  /* iterate through intermediate path components */
-  p = strchr(++path, '/');
-  while(p != NULL)
-  {
-    num_subdirs = far_datasize(dir);
+    /* children must be a whole slice of entries after this directory */
+    first = le32_to_cpu(dir->dataoff) - base;
+    if(le32_to_cpu(dir->dataoff) < base || first % sizeof(FARentry_t) != 0
+    || (first /= sizeof(FARentry_t)) > nentries
+    || nentries - first < far_datasize(dir)
+    || (far_datasize(dir) != 0 && first + 1 <= slot))
+    {
+      fprintf(stderr, "Invalid children for slot %zu\n", slot);
+      return -1;
+    }
 
-    /* look at each child for a match */
-    for(i = 0; i < num_subdirs; ++i)
+    /* a directory's names are decoded starting from its first child */
+    if(far_datasize(dir) != 0 && (far_flags & FAR_HEADER_FRONTCODED))
     {
-      /* check if the name matches */
-      entry = far_children(dir) + i;
-      name = far_name(entry);
-      if(strlen(name) == p-path && memcmp(path, name, p-path) == 0)
+      rec = (const FARname_t*)((const char*)far_mapping
+                               + le32_to_cpu(far_entries[first].nameoff));
+      if(rec->prefix != 0)
       {
-        /* we found a match; stop looking at these children */
-        *parent = dir;
-        dir = entry;
-        break;
+        fprintf(stderr, "Invalid name for entry %zu\n", first);
+        return -1;
       }
     }
 
-    /* move to the next component */
-    path = ++p;
-    p = strchr(path, '/');
-  }
+    for(i = first + 1, nlink = 2; i <= first + far_datasize(dir); ++i)
+    {
+      unclaimed = UINT32_MAX;
+      if(!__atomic_compare_exchange_n(&far_inodes[i].parent, &unclaimed, slot,
+                                      0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      {
+        fprintf(stderr, "Entry %zu has more than one parent\n", i - 1);
+        return -1;
+      }
 
-  num_subdirs = far_datasize(dir);
+      /* every subdirectory links back with '..' */
+      if(far_type(far_slot_entry(i)) == FAR_DIR_TYPE)
+        ++nlink;
+    }
 
-  /* we are at the final component; look at each child for a match */
-  for(i = 0; i < num_subdirs; ++i)
-  {
-    /* check if the name matches */
-    entry = far_children(dir) + i;
-    if(strcmp(path, far_name(entry)) == 0)
-      return entry;
+    far_inodes[slot].nlink = nlink;
   }
 
-  /* didn't find this entry */
-  return NULL;
+  return 0;
 }
 
-/*! Get attributes
+/*! Check whether two files have the same data extent
  *
- *  @param[in]  path Path to lookup
- *  @param[out] st   Buffer to fill
+ *  @param[in] a First file
+ *  @param[in] b Second file
  *
- *  @returns 0 for success
- *  @returns negated errno otherwise
+ *  @returns whether a and b share their data
  */
 static int
-far_getattr(const char  *path,
-            struct stat *st)
+far_same_data(const FARentry_t *a,
+              const FARentry_t *b)
 {
-  const FARentry_t *parent, *entry = far_traverse_path(path, &parent);
-  if(entry == NULL)
-    return -ENOENT;
+  /* a solid file's dataoff is not an archive offset */
+  return a->dataoff == b->dataoff && a->size == b->size
+      && (a->flags & cpu_to_le32(FAR_ENTRY_SOLID)) == (b->flags & cpu_to_le32(FAR_ENTRY_SOLID));
+}
 
-  far_fill_stat(entry, st);
-  return 0;
+/*! Hash a file's data extent for far_links
+ *
+ *  @param[in] entry File
+ *
+ *  @returns hash of entry's dataoff and size
+ */
+static uint64_t
+far_links_key(const FARentry_t *entry)
+{
+  return far_mix64((uint64_t)le32_to_cpu(entry->dataoff) << 32 | far_datasize(entry));
 }
 
-/*! Read a directory
+/*! Enter a range of files into far_links
  *
- *  @param[in]  path   Directory to read
- *  @param[out] buffer Buffer to fill
- *  @param[in]  filler Callback which fills buffer
- *  @param[in]  offset Directory offset
- *  @param[in]  fi     Open directory information
+ *  Each data extent ends up in one bucket, holding the lowest slot of the
+ *  files that share it.
  *
- *  @returns 0 for success
- *  @returns negated errno otherwise
+ *  @param[in] begin First slot
+ *  @param[in] end   One past the last slot
+ *
+ *  @returns 0
  */
 static int
-far_readdir(const char            *path,
-            void                  *buffer,
-            fuse_fill_dir_t       filler,
-            off_t                 offset,
-            struct fuse_file_info *fi)
+far_links_claim(size_t begin,
+                size_t end)
 {
-  struct stat     st;
-  off_t           off;
-
-  /* we set up this entry pointer in far_opendir */
-  far_dir_t        *dir = (far_dir_t*)fi->fh;
-  const FARentry_t *child;
-
-  /* offset 0 means '.' */
-  if(offset == 0)
-  {
-    far_fill_stat(dir->entry, &st);
-    if(filler(buffer, ".", &st, ++offset))
-      return 0;
-  }
+  size_t           slot, b;
+  uint32_t         cur;
+  const FARentry_t *entry;
+  int              done;
 
-  /* offset 1 means '..' */
-  if(offset == 1)
+  for(slot = begin; slot < end; ++slot)
   {
-    far_fill_stat(dir->parent, &st);
-    if(filler(buffer, "..", &st, ++offset))
-      return 0;
-  }
+    entry = far_slot_entry(slot);
+    if(far_type(entry) != FAR_FILE_TYPE || far_datasize(entry) == 0)
+      continue;
 
-  /* skip until we reach the desired offset */
-  for(off = 2; off-2 < far_datasize(dir->entry); ++off)
-  {
-    if(off == offset)
+    /* other threads insert too; retry whenever a bucket changes under us */
+    done = 0;
+    for(b = far_links_key(entry) & far_links_mask; !done; b = (b + 1) & far_links_mask)
     {
-      /* we have reached the desired offset; start filling */
-      child = far_children(dir->entry) + (off - 2);
-      far_fill_stat(child, &st);
-      if(filler(buffer, far_name(child), &st, ++offset))
-        return 0;
+      cur = __atomic_load_n(&far_links[b], __ATOMIC_RELAXED);
+      while(!done && (cur == 0 || far_same_data(far_slot_entry(cur), entry)))
+      {
+        if(cur != 0 && cur <= slot)
+          done = 1;
+        else
+          done = __atomic_compare_exchange_n(&far_links[b], &cur, slot,
+                                             0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+      }
     }
   }
 
-  return 0;;
+  return 0;
 }
 
-/*! Open a file
+/*! Link a range of files to the first slot sharing their data
  *
- *  @param[in]  path File to open
- *  @param[out] fi   Open file information
+ *  @param[in] begin First slot
+ *  @param[in] end   One past the last slot
  *
- *  @returns 0 for success
- *  @returns negated errno otherwise
+ *  @returns 0
  */
 static int
-far_open(const char            *path,
-         struct fuse_file_info *fi)
+far_links_count(size_t begin,
+                size_t end)
 {
-  const FARentry_t *parent, *entry;
+  size_t           slot, b;
+  const FARentry_t *entry;
 
-  /* lookup the path */
-  entry = far_traverse_path(path, &parent);
-  if(entry == NULL)
+  for(slot = begin; slot < end; ++slot)
   {
-    /* we didn't find it. if O_CREAT was specified, return EROFS */
-    if(fi->flags & O_CREAT)
-      return -EROFS;
-    /* otherwise, return ENOENT */
-    return -ENOENT;
-  }
-
-  /* don't allow write mode */
-  if((fi->flags & O_ACCMODE) == O_RDWR)
-    return -EACCES;
-  if((fi->flags & O_ACCMODE) == O_WRONLY)
-    return -EACCES;
+    entry = far_slot_entry(slot);
+    if(far_type(entry) != FAR_FILE_TYPE || far_datasize(entry) == 0)
+      continue;
 
-  /* set the open file info to point to our found entry */
-  fi->fh = (unsigned long)entry;
+    for(b = far_links_key(entry) & far_links_mask;
+        !far_same_data(far_slot_entry(far_links[b]), entry);
+        b = (b + 1) & far_links_mask)
+      ;
 
-  /* tell kernel to cache data */
-  fi->keep_cache = 0;
+    if(far_links[b] != slot)
+    {
+      far_inodes[slot].ino = far_links[b];
+      __atomic_add_fetch(&far_inodes[far_links[b]].nlink, 1, __ATOMIC_RELAXED);
+    }
+  }
 
   return 0;
 }
 
-/*! Read a file
+/*! Give files that share data one inode number and a link count
  *
- *  @param[in]  path   Path of open file
- *  @param[out] buffer Buffer to fill
- *  @param[in]  size   Size to fill
- *  @param[in]  offset Offset to start at
+ *  mkfar -d stores identical files once; reporting them as hard links lets
+ *  tools and the kernel see that.
  *
- *  @returns number of bytes read
- *  @returns negated errno otherwise
+ *  @returns 0 for success
+ *  @returns -1 for failure
  */
 static int
-far_read(const char            *path,
-         char                  *buffer,
-         size_t                size,
-         off_t                 offset,
-         struct fuse_file_info *fi)
+far_links_build(void)
 {
-  FARentry_t *entry = (FARentry_t*)fi->fh;
+  size_t nslots = le32_to_cpu(header->nentries) + 1, size = 16;
+  int    rc;
 
-  if(offset < 0)
-    return -EINVAL;
+  /* keep the load factor under 3/4 */
+  while(size * 3 < nslots * 4)
+    size <<= 1;
 
-  /* past end-of-file; return 0 bytes read */
-  if(offset >= far_datasize(entry))
-    return 0;
+  far_links = (uint32_t*)calloc(size, sizeof(uint32_t));
+  if(far_links == NULL)
+    return -1;
+  far_links_mask = size - 1;
 
-  /* if they want to read past end-of-file, truncate the amount to read */
-  if(offset + size > far_datasize(entry))
-    size = far_datasize(entry) - offset;
+  rc = far_parallel(far_links_claim, nslots);
+  if(rc == 0)
+    rc = far_parallel(far_links_count, nslots);
 
-  /* copy the data */
-  memcpy(buffer, far_data(entry) + offset, size);
+  free(far_links);
+  far_links = NULL;
 
-  /* return number of bytes copied */
-  return size;
+  return rc;
 }
 
-/*! Open a directory
+/*! Validate a range of perfect hash slots
  *
- *  @param[in]  path Path to open
- *  @param[out] fi   Open directory information
+ *  @param[in] begin First perfect hash slot
+ *  @param[in] end   One past the last perfect hash slot
  *
  *  @returns 0 for success
- *  @returns negated errno otherwise
+ *  @returns -1 for failure
  */
 static int
-far_opendir(const char            *path,
-            struct fuse_file_info *fi)
+far_validate_phash(size_t begin,
+                   size_t end)
 {
-  const FARentry_t *parent, *entry;
-  far_dir_t        *dir;
+  size_t            i, nentries = le32_to_cpu(header->nentries);
+  uint32_t          slot;
+  const FARphslot_t *slots = (const FARphslot_t*)(far_phash->pilots
+                                                  + le32_to_cpu(far_phash->nbuckets));
 
-  /* lookup the path */
-  entry = far_traverse_path(path, &parent);
-  if(entry == NULL)
-    return -ENOENT;
-
-  /* make sure this is a directory */
-  if(far_type(entry) != FAR_DIR_TYPE)
-    return -ENOTDIR;
-
-  dir = far_dir_new(parent, entry);
-  if(dir == NULL)
-    return -ENOMEM;
+  for(i = begin; i < end; ++i)
+  {
+    slot = le32_to_cpu(slots[i].slot);
+    if(slot == 0 || slot > nentries
+    || far_inodes[slot].parent != le32_to_cpu(slots[i].parent)
+    || far_valid_string(le32_to_cpu(slots[i].pathoff), far_size) == 0)
+    {
+      fprintf(stderr, "Invalid perfect hash slot %zu\n", i);
+      return -1;
+    }
+  }
 
-  /* set the open directory info to point to our found entry */
-  fi->fh = (unsigned long)dir;
   return 0;
 }
 
+/*! Validate the structure of the archive and build the inode table
+ *
+ *  Everything the request handlers trust is checked up front, so that they
+ *  can follow offsets without bounds checks.
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
 static int
-far_releasedir(const char            *path,
-               struct fuse_file_info *fi)
+far_validate(void)
 {
-  far_dir_t *dir = (far_dir_t*)fi->fh;
-  free(dir);
+  size_t nentries = le32_to_cpu(header->nentries);
+  int    rc;
 
-  return 0;
-}
+  far_inodes_size = (nentries + 1) * sizeof(far_inode_t);
+  far_inodes      = (far_inode_t*)malloc(far_inodes_size);
+  if(far_inodes == NULL)
+    return -1;
 
-/*! FARFS FUSE operations */
-static const struct fuse_operations far_ops =
-{
-  .getattr          = far_getattr,
-  .open             = far_open,
-  .opendir          = far_opendir,
-  .read             = far_read,
-  .readdir          = far_readdir,
-  .releasedir       = far_releasedir,
-  .flag_nullpath_ok = 1,
-  .flag_nopath      = 1,
-};
+  /* every entry starts out unclaimed; the root is its own parent */
+  memset(far_inodes, 0xFF, far_inodes_size);
+  far_inodes[0].parent = 0;
 
-/*! fuse_opt_parse callback
+  /* files are checked against the chunks and solid blocks, and
+   * directories decode their children's names, so go in that order
+   */
+  rc = far_parallel(far_validate_chunks, far_nchunks);
+  if(rc == 0)
+    rc = far_parallel(far_validate_blocks, far_nblocks);
+  if(rc == 0)
+    rc = far_parallel(far_validate_entries, nentries);
+  if(rc == 0)
+    rc = far_parallel(far_validate_dirs, nentries + 1);
+  if(rc == 0 && far_phash != NULL)
+    rc = far_parallel(far_validate_phash, nentries);
+  if(rc == 0)
+    rc = far_links_build();
+
+  if(rc != 0)
+  {
+    free(far_inodes);
+    far_inodes      = NULL;
+    far_inodes_size = 0;
+  }
+
+  return rc;
+}
+
+/*! Make a path absolute
  *
- *  @param[in]  data    Unused
- *  @param[in]  arg     Current argument
- *  @param[in]  key     Argument key
- *  @param[out] outargs Unused
+ *  fuse_main changes to "/" when it daemonizes, so paths used after that
+ *  must not depend on the starting directory. The file need not exist.
  *
- *  @returns 0 for success and discard
- *  @returns 1 for success and keep
- *  @returns -1 for failure
+ *  @param[in] path Path
+ *
+ *  @returns absolute path (free with free())
+ *  @returns NULL for failure
  */
-static int
-far_process_arg(void             *data,
-                  const char       *arg,
-                  int              key,
-                  struct fuse_args *outargs)
+static char*
+far_abspath(const char *path)
 {
-  if(key == FUSE_OPT_KEY_NONOPT)
-  {
-    if(far_file == NULL)
-    {
-      /* discard first non-option, which is the far filename */
-      far_file = arg;
-      return 0;
-    }
-  }
+  char cwd[PATH_MAX], *abs;
 
-  return 1;
+  if(path[0] == '/')
+    return strdup(path);
+
+  if(getcwd(cwd, sizeof(cwd)) == NULL)
+    return NULL;
+
+  abs = (char*)malloc(strlen(cwd) + strlen(path) + 2);
+  if(abs != NULL)
+    sprintf(abs, "%s/%s", cwd, path);
+
+  return abs;
 }
 
 int main(int argc, char *argv[])
 {
   struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
   struct stat      st;
-  int              fd, rc;
+  struct timespec  start, end;
+  far_sidecar_t    key;
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 12)
+  char             opt[32];
+#endif
+  int              fd, rc, loaded = 0;
 
   /* parse options */
-  if(fuse_opt_parse(&args, NULL, NULL, far_process_arg) != 0)
+  if(fuse_opt_parse(&args, &far_options, far_opts, far_process_arg) != 0)
     return EXIT_FAILURE;
   if(far_file == NULL)
     return EXIT_FAILURE;
 
+  /* default to one mount thread per CPU */
+  if(far_options.mount_threads == 0)
+    far_options.mount_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if(far_options.mount_threads < 1)
+    far_options.mount_threads = 1;
+  if(far_options.mount_threads > FAR_MAX_MOUNT_THREADS)
+    far_options.mount_threads = FAR_MAX_MOUNT_THREADS;
+  if(far_options.record_time == 0)
+    far_options.record_time = FAR_RECORD_TIME;
+  if(far_options.cache_size == 0)
+    far_options.cache_size = FAR_CACHE_SIZE;
+  if(far_options.io_threads == 0)
+    far_options.io_threads = FAR_IO_THREADS;
+  if(far_options.io_threads > FAR_MAX_IO_THREADS)
+    far_options.io_threads = FAR_MAX_IO_THREADS;
+  if(far_options.prefetch_depth == 0)
+    far_options.prefetch_depth = FAR_PREFETCH_DEPTH;
+  far_mem_limit = far_options.mem_limit;
+  far_mem_scale = FAR_MEM_SCALE;
+
+  if(far_options.backend == NULL || strcmp(far_options.backend, "mmap") == 0)
+    far_direct = 0;
+  else if(strcmp(far_options.backend, "direct") == 0)
+    far_direct = 1;
+  else
+  {
+    fprintf(stderr, "Unknown backend %s\n", far_options.backend);
+    return EXIT_FAILURE;
+  }
+
+  /* give each worker thread its own /dev/fuse channel */
+  if(fuse_opt_add_arg(&args, "-oclone_fd") != 0)
+    return EXIT_FAILURE;
+
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 12)
+  /* allow enough workers that reads waiting on the I/O pool cannot starve
+   * lookups; this goes first so the command line can still override it
+   */
+  snprintf(opt, sizeof(opt), "-omax_threads=%u",
+           far_options.io_threads + FAR_SPARE_WORKERS);
+  if(fuse_opt_insert_arg(&args, 1, opt) != 0)
+    return EXIT_FAILURE;
+#endif
+
   /* open the far file */
   fd = open(far_file, O_RDONLY);
   if(fd < 0)
@@ -561,6 +5231,13 @@ int main(int argc, char *argv[])
     return EXIT_FAILURE;
   }
 
+  if(st.st_size < sizeof(FARheader_t))
+  {
+    fprintf(stderr, "Truncated header\n");
+    close(fd);
+    return EXIT_FAILURE;
+  }
+
   /* set up global data about the far file */
   far_atime = st.st_atime;
   far_mtime = st.st_mtime;
@@ -574,29 +5251,150 @@ int main(int argc, char *argv[])
     close(fd);
     return EXIT_FAILURE;
   }
-  close(fd);
+  far_fd   = fd;
+  far_size = st.st_size;
 
   header = (FARheader_t*)far_mapping;
   if(le32_to_cpu(header->magic) != FAR_MAGIC)
   {
     fprintf(stderr, "Invalid magic %#x\n", le32_to_cpu(header->magic));
     munmap(far_mapping, st.st_size);
+    close(far_fd);
     return EXIT_FAILURE;
   }
-  if(le32_to_cpu(header->version) != 0)
+  if(far_parse_header(st.st_size) != 0)
   {
-    fprintf(stderr, "Invalid version %#x\n", le32_to_cpu(header->version));
     munmap(far_mapping, st.st_size);
+    close(far_fd);
     return EXIT_FAILURE;
   }
   root->size = header->rootentries;
 
+  /* map the index from the sidecar if it is current, otherwise validate the
+   * archive and build it; a sidecar is only written for a valid archive
+   */
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if(far_options.index_cache != NULL)
+    far_sidecar_key(&st, &key);
+  if(far_options.index_cache != NULL
+  && far_sidecar_load(far_options.index_cache, &key) == 0)
+    loaded = 1;
+  else if(far_validate() != 0)
+  {
+    fprintf(stderr, "Invalid archive %s\n", far_file);
+    munmap(far_mapping, st.st_size);
+    close(far_fd);
+    return EXIT_FAILURE;
+  }
+  else if(far_index_build() != 0)
+  {
+    fprintf(stderr, "Failed to build lookup structures\n");
+    far_index_free();
+    munmap(far_mapping, st.st_size);
+    close(far_fd);
+    return EXIT_FAILURE;
+  }
+  else if(far_options.index_cache != NULL
+       && far_sidecar_save(far_options.index_cache, &key) != 0)
+    fprintf(stderr, "Failed to write index cache %s\n", far_options.index_cache);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  if(far_options.stats)
+    fprintf(stderr, "index: %s in %.3f ms\n", loaded ? "loaded" : "built",
+            (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+
+  /* digest the dictionary once instead of with every compressed file */
+  if(far_dict != NULL)
+  {
+    far_zstd.ddict = ZSTD_createDDict(far_dict, far_dictsize);
+    if(far_zstd.ddict == NULL)
+    {
+      fprintf(stderr, "Invalid dictionary in %s\n", far_file);
+      far_index_free();
+      munmap(far_mapping, st.st_size);
+      close(far_fd);
+      return EXIT_FAILURE;
+    }
+  }
+
+  /* the block cache holds archive blocks for backend=direct, and
+   * decompressed solid blocks with either backend
+   */
+  if((far_direct || far_blocks != NULL) && far_cache_init() != 0)
+  {
+    fprintf(stderr, "Failed to set up the block cache\n");
+    ZSTD_freeDDict(far_zstd.ddict);
+    far_index_free();
+    munmap(far_mapping, st.st_size);
+    close(far_fd);
+    return EXIT_FAILURE;
+  }
+
+  /* read file data around the page cache, so it is only cached once, by
+   * the kernel's FUSE cache or by us
+   */
+  if(far_direct)
+  {
+    far_direct_fd = open(far_file, O_RDONLY|O_DIRECT);
+    if(far_direct_fd < 0)
+    {
+      perror("backend=direct");
+      far_cache_free();
+      ZSTD_freeDDict(far_zstd.ddict);
+      far_index_free();
+      munmap(far_mapping, st.st_size);
+      close(far_fd);
+      return EXIT_FAILURE;
+    }
+  }
+
+  /* open the startup read profiles; a new profile is written next to the
+   * old one, so the same file can be replayed and recorded at once
+   */
+  if(far_options.replay != NULL && (far_options.replay = far_abspath(far_options.replay)) == NULL)
+    perror("getcwd");
+  if(far_options.record != NULL && (far_options.record = far_abspath(far_options.record)) == NULL)
+    perror("getcwd");
+  if(far_options.replay != NULL)
+  {
+    far_replay_fp = fopen(far_options.replay, "r");
+    if(far_replay_fp == NULL)
+      perror(far_options.replay);
+  }
+  if(far_options.record != NULL)
+  {
+    far_record_tmp = (char*)malloc(strlen(far_options.record) + 32);
+    if(far_record_tmp != NULL)
+    {
+      sprintf(far_record_tmp, "%s.%ld.tmp", far_options.record, (long)getpid());
+      far_record_fp = fopen(far_record_tmp, "w");
+    }
+    if(far_record_fp == NULL)
+      perror(far_options.record);
+  }
+
   /* run the FUSE loop */
   rc = fuse_main(args.argc, args.argv, &far_ops, NULL);
 
-  /* clean up */
+  /* clean up; a profile still open here was never started */
+  if(far_record_fp != NULL)
+  {
+    fclose(far_record_fp);
+    unlink(far_record_tmp);
+  }
+  free(far_record_tmp);
+  free(far_options.record);
+  free(far_options.replay);
+  far_cache_free();
+  if(far_direct)
+    close(far_direct_fd);
+  while(far_zstd.nidle != 0)
+    ZSTD_freeDCtx(far_zstd.idle[--far_zstd.nidle]);
+  ZSTD_freeDDict(far_zstd.ddict);
   fuse_opt_free_args(&args);
+  far_index_free();
   munmap(far_mapping, st.st_size);
+  close(far_fd);
 
   return rc;
 }
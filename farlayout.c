@@ -0,0 +1,698 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "far.h"
+
+/*! Page size used for the report */
+#define FAR_PAGE_SIZE 4096
+
+/*! Rank of file data no trace touched */
+#define FAR_UNTOUCHED SIZE_MAX
+
+/*! File data extent; files sharing data share an extent */
+typedef struct far_extent_t
+{
+  uint32_t dataoff; /*!< offset (from header) to data in the old archive */
+  uint32_t size;    /*!< size of data */
+  uint32_t newoff;  /*!< offset (from header) to data in the new archive */
+  size_t   rank;    /*!< order of first access, or FAR_UNTOUCHED */
+} far_extent_t;
+
+/*! Recorded read, as written by farfs -o record */
+typedef struct far_access_t
+{
+  size_t   slot;   /*!< slot of file read */
+  uint64_t offset; /*!< offset into file */
+  uint64_t size;   /*!< bytes read */
+} far_access_t;
+
+/*! Access trace */
+typedef struct far_trace_t
+{
+  const char   *path;      /*!< trace file */
+  far_access_t *accesses;  /*!< recorded reads */
+  size_t       naccesses;  /*!< number of recorded reads */
+} far_trace_t;
+
+/*! Archive being laid out */
+typedef struct far_layout_t
+{
+  const char        *mapping;   /*!< archive contents */
+  size_t            size;       /*!< archive size */
+  const FARentry_t  *entries;   /*!< entry table */
+  size_t            nentries;   /*!< number of entries */
+  uint32_t          flags;      /*!< FAR_HEADER_* flags */
+  size_t            datastart;  /*!< offset (from header) to file data */
+  far_extent_t      *extents;   /*!< file data extents, sorted by dataoff */
+  size_t            nextents;   /*!< number of extents */
+  far_trace_t       *traces;    /*!< access traces */
+  size_t            ntraces;    /*!< number of traces */
+} far_layout_t;
+
+/*! Compare extents by old offset
+ *
+ *  @param[in] a First extent
+ *  @param[in] b Second extent
+ *
+ *  @returns comparison result
+ */
+static int
+far_extent_cmp(const void *a,
+               const void *b)
+{
+  const far_extent_t *x = (const far_extent_t*)a;
+  const far_extent_t *y = (const far_extent_t*)b;
+
+  if(x->dataoff != y->dataoff)
+    return x->dataoff < y->dataoff ? -1 : 1;
+  if(x->size != y->size)
+    return x->size < y->size ? -1 : 1;
+  return 0;
+}
+
+/*! Compare extents by rank, keeping the old order among equal ranks
+ *
+ *  @param[in] a Pointer to first extent
+ *  @param[in] b Pointer to second extent
+ *
+ *  @returns comparison result
+ */
+static int
+far_extent_rank_cmp(const void *a,
+                    const void *b)
+{
+  const far_extent_t *x = *(const far_extent_t**)a;
+  const far_extent_t *y = *(const far_extent_t**)b;
+
+  if(x->rank != y->rank)
+    return x->rank < y->rank ? -1 : 1;
+  return x < y ? -1 : x > y;
+}
+
+/*! Find the extent holding an entry's data
+ *
+ *  @param[in] lo    Layout
+ *  @param[in] entry File entry
+ *
+ *  @returns extent of entry
+ *  @returns NULL if the entry has no data
+ */
+static far_extent_t*
+far_extent_find(far_layout_t     *lo,
+                const FARentry_t *entry)
+{
+  far_extent_t key;
+
+  key.dataoff = le32_to_cpu(entry->dataoff);
+  key.size    = le32_to_cpu(entry->size);
+  if(key.size == 0)
+    return NULL;
+
+  return (far_extent_t*)bsearch(&key, lo->extents, lo->nextents, sizeof(far_extent_t),
+                                far_extent_cmp);
+}
+
+/*! Get the end of an entry's name
+ *
+ *  @param[in] lo    Layout
+ *  @param[in] entry Entry
+ *
+ *  @returns offset (from header) just past the name
+ *  @returns SIZE_MAX if the name runs off the archive
+ */
+static size_t
+far_name_end(const far_layout_t *lo,
+             const FARentry_t   *entry)
+{
+  size_t          nameoff = le32_to_cpu(entry->nameoff);
+  const FARname_t *rec;
+  const char      *nul;
+
+  if(nameoff >= lo->size)
+    return SIZE_MAX;
+
+  if(lo->flags & FAR_HEADER_FRONTCODED)
+  {
+    if(lo->size - nameoff < sizeof(FARname_t))
+      return SIZE_MAX;
+
+    rec = (const FARname_t*)(lo->mapping + nameoff);
+    return nameoff + sizeof(FARname_t) + rec->length;
+  }
+
+  nul = (const char*)memchr(lo->mapping + nameoff, '\0', lo->size - nameoff);
+  if(nul == NULL)
+    return SIZE_MAX;
+
+  return nul - lo->mapping + 1;
+}
+
+/*! Map an archive and find its file data
+ *
+ *  Everything but the file data must precede the first file, which is how
+ *  mkfar writes archives; the metadata is then copied as is.
+ *
+ *  @param[in] lo   Layout
+ *  @param[in] path Archive to open
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+far_open_archive(far_layout_t *lo,
+                 const char   *path)
+{
+  const FARheader_t  *hdr;
+  const FARheader1_t *hdr1;
+  const FARentry_t   *entry;
+  struct stat        st;
+  size_t             i, n, entryoff, metaend;
+  uint32_t           type;
+  int                fd;
+
+  fd = open(path, O_RDONLY);
+  if(fd < 0 || fstat(fd, &st) != 0)
+  {
+    perror(path);
+    if(fd >= 0)
+      close(fd);
+    return -1;
+  }
+
+  if(st.st_size < sizeof(FARheader_t))
+  {
+    fprintf(stderr, "%s: Truncated header\n", path);
+    close(fd);
+    return -1;
+  }
+
+  lo->size    = st.st_size;
+  lo->mapping = (const char*)mmap(NULL, lo->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(lo->mapping == MAP_FAILED)
+  {
+    perror(path);
+    lo->mapping = NULL;
+    return -1;
+  }
+
+  hdr = (const FARheader_t*)lo->mapping;
+  if(le32_to_cpu(hdr->magic) != FAR_MAGIC)
+  {
+    fprintf(stderr, "%s: Invalid magic %#x\n", path, le32_to_cpu(hdr->magic));
+    return -1;
+  }
+
+  lo->nentries = le32_to_cpu(hdr->nentries);
+  switch(le32_to_cpu(hdr->version))
+  {
+    case FAR_VERSION_0:
+      entryoff = sizeof(FARheader_t);
+      metaend  = entryoff;
+      break;
+
+    case FAR_VERSION_1:
+      hdr1 = (const FARheader1_t*)hdr;
+      if(lo->size < sizeof(FARheader1_t)
+      || (lo->size - sizeof(FARheader1_t)) / sizeof(FARsection_t) < le32_to_cpu(hdr1->nsections))
+      {
+        fprintf(stderr, "%s: Truncated header\n", path);
+        return -1;
+      }
+
+      lo->flags = le32_to_cpu(hdr1->flags);
+      entryoff  = le32_to_cpu(hdr1->entryoff);
+      metaend   = sizeof(FARheader1_t)
+                + le32_to_cpu(hdr1->nsections) * sizeof(FARsection_t);
+
+      for(i = 0; i < le32_to_cpu(hdr1->nsections); ++i)
+      {
+        n = (size_t)le32_to_cpu(hdr1->sections[i].offset)
+          + le32_to_cpu(hdr1->sections[i].size);
+        if(n > metaend)
+          metaend = n;
+      }
+      break;
+
+    default:
+      fprintf(stderr, "%s: Invalid version %#x\n", path, le32_to_cpu(hdr->version));
+      return -1;
+  }
+
+  if(entryoff > lo->size || (lo->size - entryoff) / sizeof(FARentry_t) < lo->nentries)
+  {
+    fprintf(stderr, "%s: Invalid entry table offset %#zx\n", path, entryoff);
+    return -1;
+  }
+  lo->entries = (const FARentry_t*)(lo->mapping + entryoff);
+  if(entryoff + lo->nentries * sizeof(FARentry_t) > metaend)
+    metaend = entryoff + lo->nentries * sizeof(FARentry_t);
+
+  /* gather every distinct piece of file data */
+  lo->extents = (far_extent_t*)calloc(lo->nentries + 1, sizeof(far_extent_t));
+  if(lo->extents == NULL)
+  {
+    fprintf(stderr, "Out of memory\n");
+    return -1;
+  }
+
+  lo->datastart = lo->size;
+  for(i = 0, n = 0; i < lo->nentries; ++i)
+  {
+    entry = lo->entries + i;
+    type  = le32_to_cpu(entry->flags);
+    if(type != FAR_FILE_TYPE && type != FAR_DIR_TYPE
+    && type != (FAR_FILE_TYPE | FAR_ENTRY_INLINE))
+    {
+      fprintf(stderr, "%s: Unsupported flags %#x for entry %zu\n", path, type, i);
+      return -1;
+    }
+
+    if(far_name_end(lo, entry) > metaend)
+      metaend = far_name_end(lo, entry);
+
+    if(type == FAR_DIR_TYPE || le32_to_cpu(entry->size) == 0)
+      continue;
+
+    if(le32_to_cpu(entry->dataoff) > lo->size
+    || lo->size - le32_to_cpu(entry->dataoff) < le32_to_cpu(entry->size))
+    {
+      fprintf(stderr, "%s: Invalid data for entry %zu\n", path, i);
+      return -1;
+    }
+
+    /* an inline file is part of the metadata and stays where it is */
+    if(type != FAR_FILE_TYPE)
+    {
+      if(le32_to_cpu(entry->dataoff) + le32_to_cpu(entry->size) > metaend)
+        metaend = le32_to_cpu(entry->dataoff) + le32_to_cpu(entry->size);
+      continue;
+    }
+
+    lo->extents[n].dataoff = le32_to_cpu(entry->dataoff);
+    lo->extents[n].size    = le32_to_cpu(entry->size);
+    lo->extents[n].rank    = FAR_UNTOUCHED;
+    if(lo->extents[n].dataoff < lo->datastart)
+      lo->datastart = lo->extents[n].dataoff;
+    ++n;
+  }
+
+  if(metaend > lo->datastart)
+  {
+    fprintf(stderr, "%s: Metadata is interleaved with file data\n", path);
+    return -1;
+  }
+
+  /* merge shared data; anything else overlapping cannot be moved apart */
+  qsort(lo->extents, n, sizeof(far_extent_t), far_extent_cmp);
+  for(i = 0, lo->nextents = 0; i < n; ++i)
+  {
+    if(lo->nextents != 0
+    && far_extent_cmp(&lo->extents[lo->nextents-1], &lo->extents[i]) == 0)
+      continue;
+
+    if(lo->nextents != 0
+    && lo->extents[lo->nextents-1].dataoff + lo->extents[lo->nextents-1].size
+         > lo->extents[i].dataoff)
+    {
+      fprintf(stderr, "%s: File data overlaps at %#x\n", path, lo->extents[i].dataoff);
+      return -1;
+    }
+
+    lo->extents[lo->nextents++] = lo->extents[i];
+  }
+
+  return 0;
+}
+
+/*! Load an access trace
+ *
+ *  Reads of entries that are not files in this archive are dropped, so a
+ *  trace recorded against another version of the archive does no harm.
+ *
+ *  @param[in] lo   Layout
+ *  @param[in] path Trace file
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+far_load_trace(far_layout_t *lo,
+               const char   *path)
+{
+  far_trace_t        *trace;
+  far_access_t       access, *accesses;
+  const FARentry_t   *entry;
+  size_t             alloc = 0;
+  unsigned long long offset, size;
+  FILE               *fp;
+  void               *p;
+
+  fp = fopen(path, "r");
+  if(fp == NULL)
+  {
+    perror(path);
+    return -1;
+  }
+
+  p = realloc(lo->traces, (lo->ntraces + 1) * sizeof(far_trace_t));
+  if(p == NULL)
+  {
+    fprintf(stderr, "Out of memory\n");
+    fclose(fp);
+    return -1;
+  }
+  lo->traces = (far_trace_t*)p;
+  trace      = lo->traces + lo->ntraces++;
+  memset(trace, 0, sizeof(*trace));
+  trace->path = path;
+
+  while(fscanf(fp, "%zu %llu %llu", &access.slot, &offset, &size) == 3)
+  {
+    if(access.slot == 0 || access.slot > lo->nentries)
+      continue;
+
+    entry = lo->entries + (access.slot - 1);
+    if(le32_to_cpu(entry->flags) != FAR_FILE_TYPE || offset >= le32_to_cpu(entry->size))
+      continue;
+
+    access.offset = offset;
+    access.size   = size;
+    if(access.size > le32_to_cpu(entry->size) - offset)
+      access.size = le32_to_cpu(entry->size) - offset;
+
+    if(trace->naccesses == alloc)
+    {
+      alloc    = alloc ? alloc * 2 : 1024;
+      accesses = (far_access_t*)realloc(trace->accesses, alloc * sizeof(far_access_t));
+      if(accesses == NULL)
+      {
+        fprintf(stderr, "Out of memory\n");
+        fclose(fp);
+        return -1;
+      }
+      trace->accesses = accesses;
+    }
+
+    trace->accesses[trace->naccesses++] = access;
+  }
+
+  if(ferror(fp) || !feof(fp))
+  {
+    fprintf(stderr, "%s: Invalid trace\n", path);
+    fclose(fp);
+    return -1;
+  }
+
+  fclose(fp);
+  return 0;
+}
+
+/*! Lay out file data in order of first access
+ *
+ *  Data the traces touch comes first, in the order the traces first read
+ *  it; the traces are taken in the order given. Everything else follows in
+ *  its old order.
+ *
+ *  @param[in] lo Layout
+ *
+ *  @returns extents in new order
+ *  @returns NULL for failure
+ */
+static far_extent_t**
+far_order(far_layout_t *lo)
+{
+  far_extent_t **order, *extent;
+  size_t       i, j, rank = 0;
+  uint64_t     offset;
+
+  for(i = 0; i < lo->ntraces; ++i)
+  {
+    for(j = 0; j < lo->traces[i].naccesses; ++j)
+    {
+      extent = far_extent_find(lo, lo->entries + (lo->traces[i].accesses[j].slot - 1));
+      if(extent != NULL && extent->rank == FAR_UNTOUCHED)
+        extent->rank = rank++;
+    }
+  }
+
+  order = (far_extent_t**)malloc((lo->nextents + 1) * sizeof(far_extent_t*));
+  if(order == NULL)
+  {
+    fprintf(stderr, "Out of memory\n");
+    return NULL;
+  }
+
+  for(i = 0; i < lo->nextents; ++i)
+    order[i] = lo->extents + i;
+  qsort(order, lo->nextents, sizeof(far_extent_t*), far_extent_rank_cmp);
+
+  /* the data region starts where it did before */
+  for(i = 0, offset = lo->datastart; i < lo->nextents; ++i)
+  {
+    order[i]->newoff = offset;
+    offset += order[i]->size;
+  }
+
+  return order;
+}
+
+/*! Count the distinct pages and seeks of a trace
+ *
+ *  A read that does not start in the page where the previous read ended, or
+ *  in the page after, counts as a seek.
+ *
+ *  @param[in]  lo     Layout
+ *  @param[in]  trace  Trace to replay
+ *  @param[in]  after  Whether to use the new layout
+ *  @param[out] pages  Distinct pages read
+ *  @param[out] seeks  Seeks
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+far_simulate(far_layout_t      *lo,
+             const far_trace_t *trace,
+             int               after,
+             uint64_t          *pages,
+             uint64_t          *seeks)
+{
+  const far_extent_t *extent;
+  uint8_t            *seen;
+  uint64_t           start, end, page, last = UINT64_MAX;
+  size_t             i;
+
+  seen = (uint8_t*)calloc(lo->size / FAR_PAGE_SIZE / 8 + 1, 1);
+  if(seen == NULL)
+  {
+    fprintf(stderr, "Out of memory\n");
+    return -1;
+  }
+
+  *pages = *seeks = 0;
+  for(i = 0; i < trace->naccesses; ++i)
+  {
+    extent = far_extent_find(lo, lo->entries + (trace->accesses[i].slot - 1));
+    if(extent == NULL || trace->accesses[i].size == 0)
+      continue;
+
+    start = (after ? extent->newoff : extent->dataoff) + trace->accesses[i].offset;
+    end   = start + trace->accesses[i].size;
+
+    if(last == UINT64_MAX
+    || (start / FAR_PAGE_SIZE != last && start / FAR_PAGE_SIZE != last + 1))
+      ++*seeks;
+    last = (end - 1) / FAR_PAGE_SIZE;
+
+    for(page = start / FAR_PAGE_SIZE; page <= last; ++page)
+    {
+      if(!(seen[page / 8] & (1 << (page % 8))))
+      {
+        seen[page / 8] |= 1 << (page % 8);
+        ++*pages;
+      }
+    }
+  }
+
+  free(seen);
+  return 0;
+}
+
+/*! Report the effect of the new layout on every trace
+ *
+ *  @param[in] lo Layout
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+far_report(far_layout_t *lo)
+{
+  uint64_t pages[2], seeks[2];
+  size_t   i;
+
+  for(i = 0; i < lo->ntraces; ++i)
+  {
+    if(far_simulate(lo, lo->traces + i, 0, &pages[0], &seeks[0]) != 0
+    || far_simulate(lo, lo->traces + i, 1, &pages[1], &seeks[1]) != 0)
+      return -1;
+
+    printf("%s: %zu reads, %" PRIu64 " -> %" PRIu64 " distinct pages, "
+           "%" PRIu64 " -> %" PRIu64 " seeks\n",
+           lo->traces[i].path, lo->traces[i].naccesses,
+           pages[0], pages[1], seeks[0], seeks[1]);
+  }
+
+  return 0;
+}
+
+/*! Write the archive with its file data in the new order
+ *
+ *  @param[in] lo      Layout
+ *  @param[in] order   Extents in new order
+ *  @param[in] outfile Path to write to
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+far_write_layout(far_layout_t       *lo,
+                 far_extent_t *const *order,
+                 const char         *outfile)
+{
+  const far_extent_t *extent;
+  FARentry_t         *entries;
+  char               *meta;
+  size_t             i;
+  FILE               *fp;
+
+  /* the metadata is unchanged apart from where files point */
+  meta = (char*)malloc(lo->datastart);
+  if(meta == NULL)
+  {
+    fprintf(stderr, "Out of memory\n");
+    return -1;
+  }
+  memcpy(meta, lo->mapping, lo->datastart);
+
+  entries = (FARentry_t*)(meta + ((const char*)lo->entries - lo->mapping));
+  for(i = 0; i < lo->nentries; ++i)
+  {
+    extent = far_extent_find(lo, lo->entries + i);
+    if(le32_to_cpu(entries[i].flags) == FAR_FILE_TYPE)
+      entries[i].dataoff = cpu_to_le32(extent != NULL ? extent->newoff : lo->datastart);
+  }
+
+  fp = fopen(outfile, "wb");
+  if(fp == NULL)
+  {
+    perror(outfile);
+    free(meta);
+    return -1;
+  }
+
+  if(fwrite(meta, 1, lo->datastart, fp) != lo->datastart)
+  {
+    perror(outfile);
+    fclose(fp);
+    free(meta);
+    return -1;
+  }
+  free(meta);
+
+  for(i = 0; i < lo->nextents; ++i)
+  {
+    if(fwrite(lo->mapping + order[i]->dataoff, 1, order[i]->size, fp) != order[i]->size)
+    {
+      perror(outfile);
+      fclose(fp);
+      return -1;
+    }
+  }
+
+  if(fclose(fp) != 0)
+  {
+    perror(outfile);
+    return -1;
+  }
+
+  return 0;
+}
+
+/*! Print usage
+ *
+ *  @param[in] prog Program name
+ */
+static void
+usage(const char *prog)
+{
+  fprintf(stderr,
+          "Usage: %s [options] <archive> <output> <trace>...\n"
+          "\n"
+          "Rewrites archive so file data is in the order the traces (from\n"
+          "farfs -o record) first read it.\n"
+          "\n"
+          "Options:\n"
+          "  -n  only report the effect; do not write output\n",
+          prog);
+}
+
+int main(int argc, char *argv[])
+{
+  far_layout_t lo;
+  far_extent_t **order = NULL;
+  int          opt, rc, dryrun = 0;
+  size_t       i;
+
+  memset(&lo, 0, sizeof(lo));
+
+  while((opt = getopt(argc, argv, "n")) != -1)
+  {
+    switch(opt)
+    {
+      case 'n':
+        dryrun = 1;
+        break;
+
+      default:
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+
+  if(argc - optind < 3)
+  {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  rc = far_open_archive(&lo, argv[optind]);
+  for(i = optind + 2; rc == 0 && i < argc; ++i)
+    rc = far_load_trace(&lo, argv[i]);
+  if(rc == 0 && (order = far_order(&lo)) == NULL)
+    rc = -1;
+  if(rc == 0)
+    rc = far_report(&lo);
+  if(rc == 0 && !dryrun)
+    rc = far_write_layout(&lo, order, argv[optind+1]);
+
+  free(order);
+  for(i = 0; i < lo.ntraces; ++i)
+    free(lo.traces[i].accesses);
+  free(lo.traces);
+  free(lo.extents);
+  if(lo.mapping != NULL)
+    munmap((void*)lo.mapping, lo.size);
+
+  return rc == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,2413 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <zstd.h>
+#include <zdict.h>
+
+#include "far.h"
+
+/*! Average number of keys per perfect hash bucket */
+#define FAR_PHASH_LOAD      4
+/*! Give up on a seed once a bucket needs this many pilots */
+#define FAR_PHASH_MAX_PILOT (1u << 24)
+/*! Most threads hashing file contents */
+#define FAR_MAX_THREADS     256
+
+/*! Smallest chunk; smaller files are stored whole */
+#define FAR_CDC_MIN         (16 << 10)
+/*! Chunk size FastCDC aims for */
+#define FAR_CDC_AVG         (64 << 10)
+/*! Largest chunk */
+#define FAR_CDC_MAX         (256 << 10)
+/*! Cut points before FAR_CDC_AVG must match more bits, and after it fewer,
+ *  which keeps chunk sizes close to the average
+ */
+#define FAR_CDC_MASK_S      (~UINT64_C(0) << (64 - 18))
+#define FAR_CDC_MASK_L      (~UINT64_C(0) << (64 - 14))
+
+/*! Largest file compressed with the dictionary; larger files compress well
+ *  enough on their own
+ */
+#define FAR_ZSTD_MAX        (16 << 10)
+/*! Dictionary size */
+#define FAR_ZSTD_DICT       (110 << 10)
+/*! Most bytes of sample files the dictionary is trained on */
+#define FAR_ZSTD_SAMPLES    (100 * FAR_ZSTD_DICT)
+/*! zstd compression level */
+#define FAR_ZSTD_LEVEL      19
+/*! Largest file stored inline among the names */
+#define FAR_INLINE_MAX      64
+/*! Largest file packed into solid blocks */
+#define FAR_SOLID_FILE      (16 << 10)
+
+/*! Archive node */
+typedef struct far_node_t
+{
+  char     *name;      /*!< entry name */
+  char     *path;      /*!< path relative to the source root */
+  int      isdir;      /*!< whether this is a directory */
+  uint64_t size;       /*!< file size */
+  size_t   parent;     /*!< slot of parent; 0 is the root directory */
+  size_t   first;      /*!< index of first child (directory) */
+  size_t   nchildren;  /*!< number of children (directory) */
+  uint32_t nameoff;    /*!< offset (from header) to name */
+  uint32_t dataoff;    /*!< offset (from header) to data (file) */
+  uint64_t hash;       /*!< hash of contents (deduplicated file) */
+  size_t   dup;        /*!< index + 1 of the node whose data this file shares; 0 for none */
+  uint32_t *chunks;    /*!< chunks making up the file, in order (chunked file) */
+  size_t   nchunks;    /*!< number of chunks (chunked file) */
+  char     *packed;    /*!< zstd frame (compressed file) */
+  uint32_t packsize;   /*!< number of bytes in packed (compressed file) */
+  size_t   block;      /*!< index + 1 of the solid block holding the file; 0 for none */
+  char     *payload;   /*!< contents (inline file) */
+} far_node_t;
+
+/*! Solid block */
+typedef struct far_block_t
+{
+  size_t   first;    /*!< index of the first node in the block */
+  uint32_t start;    /*!< offset into the solid stream where the block starts */
+  uint32_t size;     /*!< number of bytes, uncompressed */
+  char     *packed;  /*!< zstd frame */
+  uint32_t packsize; /*!< number of bytes in packed */
+  uint32_t dataoff;  /*!< offset (from header) to packed; 0 until placed */
+  int      written;  /*!< whether packed has been written */
+} far_block_t;
+
+/*! Stored chunk */
+typedef struct far_chunk_t
+{
+  uint64_t hash;    /*!< hash of contents */
+  uint64_t offset;  /*!< offset into the file of the node it was found in */
+  size_t   node;    /*!< index of the node it was found in */
+  uint32_t size;    /*!< number of bytes */
+  uint32_t dataoff; /*!< offset (from header) to data; 0 until placed */
+  int      written; /*!< whether the data has been written */
+} far_chunk_t;
+
+/*! Archive being built */
+typedef struct far_archive_t
+{
+  const char *srcdir;    /*!< source directory */
+  far_node_t *nodes;     /*!< nodes in entry table order */
+  size_t     nnodes;     /*!< number of nodes */
+  size_t     capacity;   /*!< allocated nodes */
+  size_t     rootnodes;  /*!< number of nodes in root directory */
+  int        version;    /*!< archive version to write */
+  int        phash;      /*!< whether to write a perfect hash */
+  int        frontcode;  /*!< whether to front-code names */
+  int        dedup;      /*!< whether to store identical files once */
+  unsigned   threads;    /*!< threads hashing file contents */
+  int        chunk;      /*!< whether to split files into shared chunks */
+  far_chunk_t *chunks;   /*!< stored chunks */
+  size_t     nchunks;    /*!< number of stored chunks */
+  uint32_t   *chunkhash; /*!< index + 1 of stored chunks by hash; 0 is empty */
+  size_t     chunkmask;  /*!< chunkhash size minus one */
+  int        zstd;       /*!< whether to compress small files with a dictionary */
+  char       *dict;      /*!< trained dictionary */
+  size_t     dictsize;   /*!< dictionary size */
+  ZSTD_CDict *cdict;     /*!< dictionary, digested for compression */
+  ZSTD_CCtx  *cctxs[FAR_MAX_THREADS]; /*!< idle compression contexts */
+  size_t     ncctxs;     /*!< number of idle compression contexts */
+  pthread_mutex_t lock;  /*!< protects cctxs */
+  int        solid;      /*!< whether to pack small files into solid blocks */
+  far_block_t *blocks;   /*!< solid blocks */
+  size_t     nblocks;    /*!< number of solid blocks */
+  int        tiny;       /*!< whether to store tiny files inline */
+} far_archive_t;
+
+/*! Work done on one node
+ *
+ *  @param[in] ar   Archive
+ *  @param[in] node Index of node
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+typedef int (*far_work_t)(far_archive_t *ar, size_t node);
+
+/*! Work shared by several threads */
+typedef struct far_job_t
+{
+  far_archive_t *ar;     /*!< archive */
+  far_work_t    work;    /*!< work to do on each node */
+  const size_t  *nodes;  /*!< indices of nodes to work on */
+  size_t        nnodes;  /*!< number of nodes */
+  size_t        next;    /*!< next unclaimed index into nodes */
+  int           failed;  /*!< set once any work fails */
+} far_job_t;
+
+/*! Deduplication candidate */
+typedef struct far_dup_t
+{
+  uint64_t size; /*!< file size */
+  uint64_t hash; /*!< hash of contents */
+  size_t   node; /*!< index of node */
+} far_dup_t;
+
+/*! Growable output buffer */
+typedef struct far_buf_t
+{
+  char   *data; /*!< buffer data */
+  size_t size;  /*!< bytes used */
+  size_t alloc; /*!< bytes allocated */
+} far_buf_t;
+
+/*! Reserve space at the end of a buffer
+ *
+ *  @param[in] buf  Buffer to grow
+ *  @param[in] size Number of bytes to append
+ *
+ *  @returns pointer to the zeroed new space
+ *  @returns NULL for failure
+ */
+static void*
+far_buf_append(far_buf_t *buf,
+               size_t    size)
+{
+  void *p;
+
+  if(buf->size + size > buf->alloc)
+  {
+    size_t alloc = buf->alloc ? buf->alloc : 4096;
+    while(alloc < buf->size + size)
+      alloc *= 2;
+
+    p = realloc(buf->data, alloc);
+    if(p == NULL)
+      return NULL;
+
+    buf->data  = (char*)p;
+    buf->alloc = alloc;
+  }
+
+  p = buf->data + buf->size;
+  memset(p, 0, size);
+  buf->size += size;
+
+  return p;
+}
+
+/*! Pad a buffer to an alignment
+ *
+ *  @param[in] buf   Buffer to pad
+ *  @param[in] align Alignment (power of two)
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+far_buf_align(far_buf_t *buf,
+              size_t    align)
+{
+  size_t pad = -buf->size & (align - 1);
+
+  if(pad != 0 && far_buf_append(buf, pad) == NULL)
+    return -1;
+
+  return 0;
+}
+
+/*! Append a node to the archive
+ *
+ *  @param[in] ar     Archive
+ *  @param[in] parent Slot of parent
+ *  @param[in] name   Name of node
+ *  @param[in] st     Stat of node
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+far_add_node(far_archive_t     *ar,
+             size_t            parent,
+             const char        *name,
+             const struct stat *st)
+{
+  far_node_t *node;
+  const char *ppath = parent ? ar->nodes[parent-1].path : "";
+
+  if(ar->nnodes == ar->capacity)
+  {
+    size_t capacity = ar->capacity ? ar->capacity * 2 : 1024;
+
+    node = (far_node_t*)realloc(ar->nodes, capacity * sizeof(far_node_t));
+    if(node == NULL)
+      return -1;
+
+    ar->nodes    = node;
+    ar->capacity = capacity;
+  }
+
+  node = ar->nodes + ar->nnodes;
+  memset(node, 0, sizeof(*node));
+  node->name   = strdup(name);
+  node->path   = (char*)malloc(strlen(ppath) + strlen(name) + 2);
+  node->isdir  = S_ISDIR(st->st_mode);
+  node->size   = node->isdir ? 0 : st->st_size;
+  node->parent = parent;
+  if(node->name == NULL || node->path == NULL)
+  {
+    free(node->name);
+    free(node->path);
+    return -1;
+  }
+
+  if(parent)
+    sprintf(node->path, "%s/%s", ppath, name);
+  else
+    strcpy(node->path, name);
+
+  ++ar->nnodes;
+  return 0;
+}
+
+/*! Compare nodes by name
+ *
+ *  @param[in] a First node
+ *  @param[in] b Second node
+ *
+ *  @returns <0, 0 or >0 as a sorts before, equal to or after b
+ */
+static int
+far_node_cmp(const void *a,
+             const void *b)
+{
+  return strcmp(((const far_node_t*)a)->name, ((const far_node_t*)b)->name);
+}
+
+/*! Scan a directory, appending its children to the archive
+ *
+ *  @param[in] ar   Archive
+ *  @param[in] slot Slot of directory; 0 is the root directory
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+far_scan_dir(far_archive_t *ar,
+             size_t        slot)
+{
+  DIR           *dir;
+  struct dirent *dent;
+  struct stat   st;
+  char          *path;
+  const char    *rel = slot ? ar->nodes[slot-1].path : "";
+  size_t        first = ar->nnodes;
+
+  path = (char*)malloc(strlen(ar->srcdir) + strlen(rel) + NAME_MAX + 3);
+  if(path == NULL)
+    return -1;
+
+  sprintf(path, "%s/%s", ar->srcdir, rel);
+  dir = opendir(path);
+  if(dir == NULL)
+  {
+    perror(path);
+    free(path);
+    return -1;
+  }
+
+  while((dent = readdir(dir)) != NULL)
+  {
+    if(strcmp(dent->d_name, ".") == 0 || strcmp(dent->d_name, "..") == 0)
+      continue;
+
+    sprintf(path, "%s/%s%s%s", ar->srcdir, rel, slot ? "/" : "", dent->d_name);
+    if(lstat(path, &st) != 0)
+    {
+      perror(path);
+      break;
+    }
+
+    /* only files and directories can be represented */
+    if(!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode))
+    {
+      fprintf(stderr, "Skipping %s: not a file or directory\n", path);
+      continue;
+    }
+    if(st.st_size > UINT32_MAX)
+    {
+      fprintf(stderr, "%s: file too large\n", path);
+      break;
+    }
+    if(ar->frontcode && strlen(dent->d_name) > FAR_NAME_MAX)
+    {
+      fprintf(stderr, "%s: name too long\n", path);
+      break;
+    }
+
+    if(far_add_node(ar, slot, dent->d_name, &st) != 0)
+    {
+      perror("far_add_node");
+      break;
+    }
+  }
+
+  closedir(dir);
+  free(path);
+
+  /* dent is only NULL if we read the whole directory */
+  if(dent != NULL)
+    return -1;
+
+  /* sort bytewise so readers can binary search; the children have not been
+   * scanned yet, so nothing refers to their positions
+   */
+  qsort(ar->nodes + first, ar->nnodes - first, sizeof(far_node_t), far_node_cmp);
+
+  if(slot)
+  {
+    ar->nodes[slot-1].first     = first;
+    ar->nodes[slot-1].nchildren = ar->nnodes - first;
+  }
+  else
+    ar->rootnodes = ar->nnodes;
+
+  return 0;
+}
+
+/*! Scan the source tree breadth-first
+ *
+ *  Every directory's children end up contiguous in the entry table, sorted
+ *  bytewise by name.
+ *
+ *  @param[in] ar Archive
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+far_scan(far_archive_t *ar)
+{
+  size_t i;
+
+  if(far_scan_dir(ar, 0) != 0)
+    return -1;
+
+  for(i = 0; i < ar->nnodes; ++i)
+  {
+    if(ar->nodes[i].isdir && far_scan_dir(ar, i+1) != 0)
+      return -1;
+  }
+
+  return 0;
+}
+
+/*! Search for a value in an array
+ *
+ *  @param[in] array Array to search
+ *  @param[in] value Value to look for
+ *  @param[in] count Number of elements in array
+ *
+ *  @returns whether value is in array
+ */
+static int
+far_contains(const uint32_t *array,
+           uint32_t       value,
+           size_t         count)
+{
+  while(count-- > 0)
+  {
+    if(*array++ == value)
+      return 1;
+  }
+
+  return 0;
+}
+
+/*! Build the perfect hash section
+ *
+ *  @param[in] ar      Archive
+ *  @param[in] meta    Metadata buffer to append section to
+ *  @param[in] section Section descriptor to fill
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+far_build_phash(far_archive_t *ar,
+                far_buf_t     *meta,
+                FARsection_t  *section)
+{
+  size_t      n = ar->nnodes, i, j, k, start, nplaced;
+  uint32_t    nbuckets = n / FAR_PHASH_LOAD + 1, seed, pilot, b;
+  uint64_t    *keys;
+  uint32_t    *pilots, *slotof, *count, *bstart, *members, *order;
+  uint8_t     *taken;
+  FARphash_t  *phash;
+  FARphslot_t *slots;
+  int         rc = -1;
+
+  keys    = (uint64_t*)malloc(n * sizeof(uint64_t));
+  pilots  = (uint32_t*)calloc(nbuckets, sizeof(uint32_t));
+  slotof  = (uint32_t*)malloc(n * sizeof(uint32_t));
+  count   = (uint32_t*)malloc((nbuckets + 1) * sizeof(uint32_t));
+  bstart  = (uint32_t*)malloc((nbuckets + 1) * sizeof(uint32_t));
+  members = (uint32_t*)malloc(n * sizeof(uint32_t));
+  order   = (uint32_t*)malloc(nbuckets * sizeof(uint32_t));
+  taken   = (uint8_t*)malloc(n);
+  if(!keys || !pilots || !slotof || !count || !bstart || !members || !order || !taken)
+    goto out;
+
+  for(seed = 0; ; ++seed)
+  {
+    /* hash every path and bucket the keys */
+    memset(count, 0, (nbuckets + 1) * sizeof(uint32_t));
+    for(i = 0; i < n; ++i)
+    {
+      keys[i] = far_phash_key(ar->nodes[i].path, strlen(ar->nodes[i].path), seed);
+      ++count[far_phash_bucket(keys[i], nbuckets)];
+    }
+
+    for(b = 0, start = 0; b < nbuckets; ++b)
+    {
+      bstart[b] = start;
+      start    += count[b];
+    }
+    bstart[nbuckets] = start;
+
+    memset(count, 0, nbuckets * sizeof(uint32_t));
+    for(i = 0; i < n; ++i)
+    {
+      b = far_phash_bucket(keys[i], nbuckets);
+      members[bstart[b] + count[b]++] = i;
+    }
+
+    /* place the largest buckets first, while the table is still empty */
+    for(b = 0, j = 0; b < nbuckets; ++b)
+    {
+      if(count[b] > j)
+        j = count[b];
+    }
+    for(k = 0; j > 0; --j)
+    {
+      for(b = 0; b < nbuckets; ++b)
+      {
+        if(count[b] == j)
+          order[k++] = b;
+      }
+    }
+
+    memset(taken, 0, n);
+    memset(pilots, 0, nbuckets * sizeof(uint32_t));
+    for(i = 0, nplaced = 0; i < k; ++i, ++nplaced)
+    {
+      b = order[i];
+      for(pilot = 0; pilot < FAR_PHASH_MAX_PILOT; ++pilot)
+      {
+        /* find a pilot that sends every key to a free, distinct slot */
+        for(j = 0; j < count[b]; ++j)
+        {
+          slotof[j] = far_phash_slot(keys[members[bstart[b] + j]], pilot, n);
+          if(taken[slotof[j]] || far_contains(slotof, slotof[j], j))
+            break;
+        }
+
+        if(j == count[b])
+          break;
+      }
+
+      if(pilot == FAR_PHASH_MAX_PILOT)
+        break;
+
+      pilots[b] = pilot;
+      for(j = 0; j < count[b]; ++j)
+        taken[slotof[j]] = 1;
+    }
+
+    /* every non-empty bucket was placed */
+    if(nplaced == k)
+      break;
+  }
+
+  /* emit the section: pilots, slots, then the paths they verify against */
+  section->type   = cpu_to_le32(FAR_SECTION_PHASH);
+  section->offset = cpu_to_le32(meta->size);
+
+  start = meta->size;
+  phash = (FARphash_t*)far_buf_append(meta, sizeof(FARphash_t)
+                                            + nbuckets * sizeof(uint32_t)
+                                            + n * sizeof(FARphslot_t));
+  if(phash == NULL)
+    goto out;
+
+  phash->seed     = cpu_to_le32(seed);
+  phash->nbuckets = cpu_to_le32(nbuckets);
+  phash->nslots   = cpu_to_le32(n);
+  for(b = 0; b < nbuckets; ++b)
+    phash->pilots[b] = cpu_to_le32(pilots[b]);
+
+  for(i = 0; i < n; ++i)
+  {
+    size_t   len  = strlen(ar->nodes[i].path) + 1;
+    uint32_t off  = meta->size;
+    uint32_t slot = far_phash_slot(keys[i], pilots[far_phash_bucket(keys[i], nbuckets)], n);
+    char     *p   = (char*)far_buf_append(meta, len);
+
+    if(p == NULL)
+      goto out;
+    memcpy(p, ar->nodes[i].path, len);
+
+    /* the buffer may have moved */
+    phash = (FARphash_t*)(meta->data + start);
+    slots = (FARphslot_t*)(phash->pilots + nbuckets);
+    slots[slot].slot    = cpu_to_le32(i + 1);
+    slots[slot].parent  = cpu_to_le32(ar->nodes[i].parent);
+    slots[slot].pathoff = cpu_to_le32(off);
+  }
+
+  section->size = cpu_to_le32(meta->size - start);
+  rc = 0;
+
+out:
+  free(keys);
+  free(pilots);
+  free(slotof);
+  free(count);
+  free(bstart);
+  free(members);
+  free(order);
+  free(taken);
+  return rc;
+}
+
+/*! Append the names, and the data of inline files, to the archive
+ *
+ *  @param[in] ar   Archive
+ *  @param[in] meta Metadata buffer to append names to
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+far_build_names(far_archive_t *ar,
+                far_buf_t     *meta)
+{
+  size_t     i, len, prefix;
+  const char *prev;
+  FARname_t  *rec;
+  char       *p;
+
+  for(i = 0; i < ar->nnodes; ++i)
+  {
+    far_node_t *node = ar->nodes + i;
+
+    len           = strlen(node->name);
+    node->nameoff = meta->size;
+
+    if(!ar->frontcode)
+    {
+      if((p = (char*)far_buf_append(meta, len + 1)) == NULL)
+        return -1;
+      memcpy(p, node->name, len + 1);
+    }
+    else
+    {
+      /* share a prefix with the previous sibling, except at restarts */
+      prefix = 0;
+      if(i % FAR_NAME_RESTART != 0 && node->parent == node[-1].parent)
+      {
+        prev = node[-1].name;
+        while(prefix < len && prev[prefix] == node->name[prefix])
+          ++prefix;
+      }
+
+      rec = (FARname_t*)far_buf_append(meta, sizeof(FARname_t) + len - prefix);
+      if(rec == NULL)
+        return -1;
+
+      rec->prefix = prefix;
+      rec->length = len - prefix;
+      memcpy(rec->suffix, node->name + prefix, len - prefix);
+    }
+
+    /* an inline file's data is on the same page as its name */
+    if(node->payload != NULL)
+    {
+      node->dataoff = meta->size;
+      if((p = (char*)far_buf_append(meta, node->size)) == NULL)
+        return -1;
+      memcpy(p, node->payload, node->size);
+    }
+  }
+
+  return 0;
+}
+
+/*! Build the name hash section
+ *
+ *  @param[in] ar      Archive
+ *  @param[in] meta    Metadata buffer to append section to
+ *  @param[in] section Section descriptor to fill
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+far_build_namehash(far_archive_t *ar,
+                   far_buf_t     *meta,
+                   FARsection_t  *section)
+{
+  size_t   i;
+  uint32_t *hashes;
+
+  section->type   = cpu_to_le32(FAR_SECTION_NAMEHASH);
+  section->offset = cpu_to_le32(meta->size);
+  section->size   = cpu_to_le32(ar->nnodes * sizeof(uint32_t));
+
+  hashes = (uint32_t*)far_buf_append(meta, ar->nnodes * sizeof(uint32_t));
+  if(hashes == NULL)
+    return -1;
+
+  for(i = 0; i < ar->nnodes; ++i)
+    hashes[i] = cpu_to_le32(far_name_hash(ar->nodes[i].name, strlen(ar->nodes[i].name)));
+
+  return 0;
+}
+
+/*! Open a file of the source tree
+ *
+ *  @param[in]  ar   Archive
+ *  @param[in]  node Node of file
+ *  @param[out] path Full path of file; free it when done
+ *
+ *  @returns file descriptor
+ *  @returns -1 for failure
+ */
+static int
+far_open_node(far_archive_t    *ar,
+              const far_node_t *node,
+              char             **path)
+{
+  int fd;
+
+  *path = (char*)malloc(strlen(ar->srcdir) + strlen(node->path) + 2);
+  if(*path == NULL)
+  {
+    perror("malloc");
+    return -1;
+  }
+  sprintf(*path, "%s/%s", ar->srcdir, node->path);
+
+  fd = open(*path, O_RDONLY);
+  if(fd < 0)
+  {
+    perror(*path);
+    free(*path);
+    *path = NULL;
+  }
+
+  return fd;
+}
+
+/*! Thread working through a job
+ *
+ *  @param[in] arg Job
+ *
+ *  @returns NULL
+ */
+static void*
+far_job_worker(void *arg)
+{
+  far_job_t *job = (far_job_t*)arg;
+  size_t    i;
+
+  while(!__atomic_load_n(&job->failed, __ATOMIC_RELAXED)
+     && (i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->nnodes)
+  {
+    if(job->work(job->ar, job->nodes[i]) != 0)
+      __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+  }
+
+  return NULL;
+}
+
+/*! Do work on nodes with several threads
+ *
+ *  @param[in] ar     Archive
+ *  @param[in] work   Work to do on each node
+ *  @param[in] nodes  Indices of nodes to work on
+ *  @param[in] nnodes Number of nodes
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+far_parallel(far_archive_t *ar,
+             far_work_t    work,
+             const size_t  *nodes,
+             size_t        nnodes)
+{
+  far_job_t job = { ar, work, nodes, nnodes, 0, 0 };
+  pthread_t threads[FAR_MAX_THREADS];
+  unsigned  i, nthreads = 0;
+
+  /* this thread works too, so start one fewer */
+  while(nthreads + 1 < ar->threads && nthreads < nnodes
+     && pthread_create(&threads[nthreads], NULL, far_job_worker, &job) == 0)
+    ++nthreads;
+
+  far_job_worker(&job);
+  for(i = 0; i < nthreads; ++i)
+    pthread_join(threads[i], NULL);
+
+  return job.failed ? -1 : 0;
+}
+
+/*! Hash a file's contents
+ *
+ *  @param[in] ar   Archive
+ *  @param[in] node Index of node
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+far_hash_node(far_archive_t *ar,
+              size_t        node)
+{
+  char     buffer[65536], *path;
+  ssize_t  rc;
+  uint64_t hash = FAR_HASH_INIT;
+  int      fd;
+
+  fd = far_open_node(ar, ar->nodes + node, &path);
+  if(fd < 0)
+    return -1;
+
+  while((rc = read(fd, buffer, sizeof(buffer))) > 0)
+    hash = far_hash_more(hash, buffer, rc);
+
+  close(fd);
+
+  if(rc < 0)
+  {
+    perror(path);
+    free(path);
+    return -1;
+  }
+
+  ar->nodes[node].hash = hash;
+  free(path);
+  return 0;
+}
+
+/*! Check that a file really matches the one it is to share data with
+ *
+ *  Hashes only nominate duplicates; a file whose contents differ keeps its
+ *  own data.
+ *
+ *  @param[in] ar   Archive
+ *  @param[in] node Index of node
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+far_verify_dup(far_archive_t *ar,
+               size_t        node)
+{
+  char    a[65536], b[65536], *apath, *bpath;
+  ssize_t arc, brc = 0;
+  int     afd, bfd;
+
+  afd = far_open_node(ar, ar->nodes + node, &apath);
+  if(afd < 0)
+    return -1;
+  bfd = far_open_node(ar, ar->nodes + ar->nodes[node].dup - 1, &bpath);
+  if(bfd < 0)
+  {
+    close(afd);
+    free(apath);
+    return -1;
+  }
+
+  while((arc = read(afd, a, sizeof(a))) > 0)
+  {
+    /* regular files only come up short at the end */
+    brc = read(bfd, b, arc);
+    if(brc != arc || memcmp(a, b, arc) != 0)
+      break;
+  }
+  if(arc == 0 && brc >= 0)
+    brc = read(bfd, b, 1);
+
+  if(arc < 0 || brc < 0)
+    perror(arc < 0 ? apath : bpath);
+  else if(arc != 0 || brc != 0)
+    ar->nodes[node].dup = 0;
+
+  close(afd);
+  close(bfd);
+  free(apath);
+  free(bpath);
+
+  return arc < 0 || brc < 0 ? -1 : 0;
+}
+
+/*! Compare deduplication candidates by size, then by node
+ *
+ *  @param[in] a First candidate
+ *  @param[in] b Second candidate
+ *
+ *  @returns <0, 0 or >0 as a sorts before, equal to or after b
+ */
+static int
+far_dup_size_cmp(const void *a,
+                 const void *b)
+{
+  const far_dup_t *x = (const far_dup_t*)a, *y = (const far_dup_t*)b;
+
+  if(x->size != y->size)
+    return x->size < y->size ? -1 : 1;
+  return x->node < y->node ? -1 : x->node > y->node;
+}
+
+/*! Compare deduplication candidates by size, then by hash, then by node
+ *
+ *  @param[in] a First candidate
+ *  @param[in] b Second candidate
+ *
+ *  @returns <0, 0 or >0 as a sorts before, equal to or after b
+ */
+static int
+far_dup_hash_cmp(const void *a,
+                 const void *b)
+{
+  const far_dup_t *x = (const far_dup_t*)a, *y = (const far_dup_t*)b;
+
+  if(x->hash != y->hash && x->size == y->size)
+    return x->hash < y->hash ? -1 : 1;
+  return far_dup_size_cmp(a, b);
+}
+
+/*! Find files with identical contents
+ *
+ *  Only files that share their size with another are hashed. Files whose
+ *  hashes match are compared, and each duplicate is pointed at the first
+ *  node in the entry table with the same contents.
+ *
+ *  @param[in] ar Archive
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+far_dedup(far_archive_t *ar)
+{
+  far_dup_t *dups;
+  size_t    *nodes, ndups = 0, nnodes = 0, i, first;
+  int       rc;
+
+  dups  = (far_dup_t*)malloc(ar->nnodes * sizeof(far_dup_t) + 1);
+  nodes = (size_t*)malloc(ar->nnodes * sizeof(size_t) + 1);
+  if(dups == NULL || nodes == NULL)
+  {
+    fprintf(stderr, "Out of memory\n");
+    free(dups);
+    free(nodes);
+    return -1;
+  }
+
+  /* empty files have no data to share */
+  for(i = 0; i < ar->nnodes; ++i)
+  {
+    if(!ar->nodes[i].isdir && ar->nodes[i].size != 0)
+    {
+      dups[ndups].size = ar->nodes[i].size;
+      dups[ndups].hash = 0;
+      dups[ndups].node = i;
+      ++ndups;
+    }
+  }
+
+  /* a file of a unique size cannot have a duplicate */
+  qsort(dups, ndups, sizeof(far_dup_t), far_dup_size_cmp);
+  for(i = 0; i < ndups; ++i)
+  {
+    if((i > 0 && dups[i-1].size == dups[i].size)
+    || (i + 1 < ndups && dups[i+1].size == dups[i].size))
+    {
+      dups[nnodes]    = dups[i];
+      nodes[nnodes++] = dups[i].node;
+    }
+  }
+  ndups = nnodes;
+
+  rc = far_parallel(ar, far_hash_node, nodes, nnodes);
+  if(rc == 0)
+  {
+    for(i = 0; i < ndups; ++i)
+      dups[i].hash = ar->nodes[dups[i].node].hash;
+    qsort(dups, ndups, sizeof(far_dup_t), far_dup_hash_cmp);
+
+    /* every run of equal sizes and hashes shares the data of its first */
+    for(i = 0, first = 0, nnodes = 0; i < ndups; ++i)
+    {
+      if(dups[i].size != dups[first].size || dups[i].hash != dups[first].hash)
+        first = i;
+      else if(i != first)
+      {
+        ar->nodes[dups[i].node].dup = dups[first].node + 1;
+        nodes[nnodes++] = dups[i].node;
+      }
+    }
+
+    rc = far_parallel(ar, far_verify_dup, nodes, nnodes);
+  }
+
+  free(dups);
+  free(nodes);
+  return rc;
+}
+
+/*! FastCDC gear table */
+static uint64_t far_gear[256];
+
+/*! Find the end of the next chunk
+ *
+ *  @param[in] data Data left in the file
+ *  @param[in] size Bytes of data; all of the file that is left, or at
+ *                  least FAR_CDC_MAX
+ *
+ *  @returns size of the chunk
+ */
+static size_t
+far_cdc_cut(const unsigned char *data,
+            size_t              size)
+{
+  uint64_t hash = 0;
+  size_t   i, normal = FAR_CDC_AVG;
+
+  if(size <= FAR_CDC_MIN)
+    return size;
+  if(size > FAR_CDC_MAX)
+    size = FAR_CDC_MAX;
+  if(normal > size)
+    normal = size;
+
+  /* nothing before the minimum can be a cut point, so skip hashing it */
+  for(i = FAR_CDC_MIN; i < normal; ++i)
+  {
+    hash = (hash << 1) + far_gear[data[i]];
+    if(!(hash & FAR_CDC_MASK_S))
+      return i + 1;
+  }
+
+  for(; i < size; ++i)
+  {
+    hash = (hash << 1) + far_gear[data[i]];
+    if(!(hash & FAR_CDC_MASK_L))
+      return i + 1;
+  }
+
+  return size;
+}
+
+/*! Check whether a stored chunk holds some data
+ *
+ *  @param[in] ar    Archive
+ *  @param[in] chunk Stored chunk
+ *  @param[in] data  Data to compare, chunk->size bytes
+ *
+ *  @returns 1 if they match
+ *  @returns 0 if they differ
+ *  @returns -1 for failure
+ */
+static int
+far_chunk_equal(far_archive_t     *ar,
+                const far_chunk_t *chunk,
+                const char        *data)
+{
+  char    *path, *buffer;
+  ssize_t rc;
+  int     fd, same;
+
+  buffer = (char*)malloc(chunk->size);
+  if(buffer == NULL)
+  {
+    perror("malloc");
+    return -1;
+  }
+
+  fd = far_open_node(ar, ar->nodes + chunk->node, &path);
+  if(fd < 0)
+  {
+    free(buffer);
+    return -1;
+  }
+
+  rc = pread(fd, buffer, chunk->size, chunk->offset);
+  if(rc < 0)
+    perror(path);
+  same = rc == chunk->size && memcmp(buffer, data, chunk->size) == 0;
+
+  close(fd);
+  free(path);
+  free(buffer);
+
+  return rc < 0 ? -1 : same;
+}
+
+/*! Add a chunk of a file, storing it unless an identical one is stored
+ *
+ *  @param[in] ar     Archive
+ *  @param[in] node   Index of node
+ *  @param[in] offset Offset of the chunk in the file
+ *  @param[in] data   Chunk data
+ *  @param[in] size   Bytes of data
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+far_add_chunk(far_archive_t *ar,
+              size_t        node,
+              uint64_t      offset,
+              const char    *data,
+              size_t        size)
+{
+  far_node_t  *n = ar->nodes + node;
+  far_chunk_t *chunk;
+  uint64_t    hash = far_hash_more(FAR_HASH_INIT, data, size);
+  uint32_t    *chunks;
+  size_t      b;
+  int         rc;
+
+  for(b = far_mix64(hash ^ size) & ar->chunkmask; ar->chunkhash[b] != 0;
+      b = (b + 1) & ar->chunkmask)
+  {
+    chunk = ar->chunks + ar->chunkhash[b] - 1;
+    if(chunk->hash == hash && chunk->size == size
+    && (rc = far_chunk_equal(ar, chunk, data)) != 0)
+    {
+      if(rc < 0)
+        return -1;
+      break;
+    }
+  }
+
+  if(ar->chunkhash[b] == 0)
+  {
+    chunk = ar->chunks + ar->nchunks++;
+    chunk->hash    = hash;
+    chunk->offset  = offset;
+    chunk->node    = node;
+    chunk->size    = size;
+    chunk->dataoff = 0;
+    chunk->written = 0;
+    ar->chunkhash[b] = ar->nchunks;
+  }
+
+  /* grow whenever the count reaches a power of two */
+  if((n->nchunks & (n->nchunks - 1)) == 0)
+  {
+    chunks = (uint32_t*)realloc(n->chunks, (n->nchunks ? 2 * n->nchunks : 1) * sizeof(uint32_t));
+    if(chunks == NULL)
+    {
+      perror("realloc");
+      return -1;
+    }
+    n->chunks = chunks;
+  }
+  n->chunks[n->nchunks++] = ar->chunkhash[b] - 1;
+
+  return 0;
+}
+
+/*! Split a file into content-defined chunks
+ *
+ *  @param[in] ar   Archive
+ *  @param[in] node Index of node
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+far_chunk_file(far_archive_t *ar,
+               size_t        node)
+{
+  char     *buffer, *path;
+  size_t   pos = 0, len = 0, cut;
+  ssize_t  rc = 1;
+  uint64_t offset = 0;
+  int      fd;
+
+  buffer = (char*)malloc(2 * FAR_CDC_MAX);
+  if(buffer == NULL)
+  {
+    perror("malloc");
+    return -1;
+  }
+
+  fd = far_open_node(ar, ar->nodes + node, &path);
+  if(fd < 0)
+  {
+    free(buffer);
+    return -1;
+  }
+
+  while(1)
+  {
+    /* keep at least a whole chunk buffered until the end of the file */
+    if(rc > 0 && len - pos < FAR_CDC_MAX)
+    {
+      memmove(buffer, buffer + pos, len - pos);
+      len -= pos;
+      pos  = 0;
+      while(len < 2 * FAR_CDC_MAX && (rc = read(fd, buffer + len, 2 * FAR_CDC_MAX - len)) > 0)
+        len += rc;
+      if(rc < 0)
+        break;
+    }
+
+    if(pos == len)
+      break;
+
+    /* a file that grew is caught below */
+    cut = far_cdc_cut((const unsigned char*)buffer + pos, len - pos);
+    if(offset + cut > ar->nodes[node].size)
+      break;
+    if(far_add_chunk(ar, node, offset, buffer + pos, cut) != 0)
+    {
+      close(fd);
+      free(buffer);
+      free(path);
+      return -1;
+    }
+
+    pos    += cut;
+    offset += cut;
+  }
+
+  close(fd);
+  free(buffer);
+
+  if(rc < 0 || offset != ar->nodes[node].size)
+  {
+    fprintf(stderr, "%s: %s\n", path, rc < 0 ? strerror(errno) : "file changed while reading");
+    free(path);
+    return -1;
+  }
+
+  free(path);
+  return 0;
+}
+
+/*! Split every large file into content-defined chunks
+ *
+ *  Chunks are found with FastCDC and stored once, so files that only
+ *  partly match, such as successive versions of one asset, share whatever
+ *  they have in common.
+ *
+ *  @param[in] ar Archive
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+far_chunk(far_archive_t *ar)
+{
+  uint64_t bound = 0;
+  size_t   i, size = 16;
+
+  for(i = 0; i < 256; ++i)
+    far_gear[i] = far_mix64(i + 1);
+
+  /* no file can produce more chunks than this */
+  for(i = 0; i < ar->nnodes; ++i)
+  {
+    if(!ar->nodes[i].isdir && !ar->nodes[i].dup && ar->nodes[i].size > FAR_CDC_MIN)
+      bound += ar->nodes[i].size / FAR_CDC_MIN + 1;
+  }
+
+  /* keep the load factor under 1/2 */
+  while(size < 2 * bound)
+    size <<= 1;
+
+  ar->chunks    = (far_chunk_t*)malloc(bound * sizeof(far_chunk_t) + 1);
+  ar->chunkhash = (uint32_t*)calloc(size, sizeof(uint32_t));
+  ar->chunkmask = size - 1;
+  if(ar->chunks == NULL || ar->chunkhash == NULL)
+  {
+    fprintf(stderr, "Out of memory\n");
+    return -1;
+  }
+
+  for(i = 0; i < ar->nnodes; ++i)
+  {
+    if(!ar->nodes[i].isdir && !ar->nodes[i].dup && ar->nodes[i].size > FAR_CDC_MIN
+    && far_chunk_file(ar, i) != 0)
+      return -1;
+  }
+
+  return 0;
+}
+
+/*! Copy the chunks a file stores first to the archive
+ *
+ *  Chunks are stored in the order they were found, so every chunk not yet
+ *  written comes from this file.
+ *
+ *  @param[in] ar   Archive
+ *  @param[in] node Node of file
+ *  @param[in] fp   Archive being written
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+far_copy_chunks(far_archive_t    *ar,
+                const far_node_t *node,
+                FILE             *fp)
+{
+  char        *buffer, *path;
+  far_chunk_t *chunk;
+  ssize_t     rc = 0;
+  size_t      i;
+  int         fd;
+
+  buffer = (char*)malloc(FAR_CDC_MAX);
+  if(buffer == NULL)
+  {
+    perror("malloc");
+    return -1;
+  }
+
+  fd = far_open_node(ar, node, &path);
+  if(fd < 0)
+  {
+    free(buffer);
+    return -1;
+  }
+
+  for(i = 0; i < node->nchunks; ++i)
+  {
+    chunk = ar->chunks + node->chunks[i];
+    if(chunk->written)
+      continue;
+
+    rc = pread(fd, buffer, chunk->size, chunk->offset);
+    if(rc != chunk->size || fwrite(buffer, 1, rc, fp) != (size_t)rc)
+      break;
+    chunk->written = 1;
+  }
+
+  close(fd);
+  free(buffer);
+
+  if(i != node->nchunks)
+  {
+    fprintf(stderr, "%s: %s\n", path, rc < 0 ? strerror(errno) : "file changed while reading");
+    free(path);
+    return -1;
+  }
+
+  free(path);
+  return 0;
+}
+
+/*! Build the chunk lists of chunked files and the chunk section
+ *
+ *  The chunk section is filled in by far_fill_chunks once the chunks have
+ *  been placed.
+ *
+ *  @param[in] ar      Archive
+ *  @param[in] meta    Metadata buffer to append to
+ *  @param[in] section Section descriptor to fill
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+far_build_chunks(far_archive_t *ar,
+                 far_buf_t     *meta,
+                 FARsection_t  *section)
+{
+  FARchunklist_t *list;
+  far_node_t     *node;
+  size_t         i, j;
+  uint32_t       end;
+
+  for(i = 0; i < ar->nnodes; ++i)
+  {
+    node = ar->nodes + i;
+    if(node->chunks == NULL)
+      continue;
+
+    node->dataoff = meta->size;
+    list = (FARchunklist_t*)far_buf_append(meta, sizeof(FARchunklist_t)
+                                           + node->nchunks * sizeof(FARchunkref_t));
+    if(list == NULL)
+      return -1;
+
+    list->count = cpu_to_le32(node->nchunks);
+    for(j = 0, end = 0; j < node->nchunks; ++j)
+    {
+      end += ar->chunks[node->chunks[j]].size;
+      list->refs[j].chunk = cpu_to_le32(node->chunks[j]);
+      list->refs[j].end   = cpu_to_le32(end);
+    }
+  }
+
+  section->type   = cpu_to_le32(FAR_SECTION_CHUNKS);
+  section->offset = cpu_to_le32(meta->size);
+  section->size   = cpu_to_le32(ar->nchunks * sizeof(FARchunk_t));
+
+  if(far_buf_append(meta, ar->nchunks * sizeof(FARchunk_t)) == NULL)
+    return -1;
+
+  return 0;
+}
+
+/*! Fill in the chunk section
+ *
+ *  @param[in] ar     Archive
+ *  @param[in] chunks Chunk section
+ */
+static void
+far_fill_chunks(far_archive_t *ar,
+                FARchunk_t    *chunks)
+{
+  size_t i;
+
+  for(i = 0; i < ar->nchunks; ++i)
+  {
+    chunks[i].offset = cpu_to_le32(ar->chunks[i].dataoff);
+    chunks[i].size   = cpu_to_le32(ar->chunks[i].size);
+  }
+}
+
+/*! Read all of a small file
+ *
+ *  @param[in]  ar     Archive
+ *  @param[in]  node   Node of file
+ *  @param[out] buffer Buffer to fill, at least the size of the file
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+far_read_node(far_archive_t    *ar,
+              const far_node_t *node,
+              char             *buffer)
+{
+  char    *path, extra;
+  ssize_t rc = 0;
+  size_t  total;
+  int     fd;
+
+  fd = far_open_node(ar, node, &path);
+  if(fd < 0)
+    return -1;
+
+  for(total = 0; total < node->size; total += rc)
+  {
+    rc = read(fd, buffer + total, node->size - total);
+    if(rc <= 0)
+      break;
+  }
+
+  /* the file must still end where the scan saw it end */
+  if(total == node->size)
+    rc = read(fd, &extra, 1);
+
+  close(fd);
+
+  if(rc != 0 || total != node->size)
+  {
+    fprintf(stderr, "%s: %s\n", path, rc < 0 ? strerror(errno) : "file changed while reading");
+    free(path);
+    return -1;
+  }
+
+  free(path);
+  return 0;
+}
+
+/*! Get a compression context
+ *
+ *  Contexts are large, so they are reused.
+ *
+ *  @param[in] ar Archive
+ *
+ *  @returns context; give it back with far_cctx_put
+ *  @returns NULL for failure
+ */
+static ZSTD_CCtx*
+far_cctx_get(far_archive_t *ar)
+{
+  ZSTD_CCtx *cctx = NULL;
+
+  pthread_mutex_lock(&ar->lock);
+  if(ar->ncctxs != 0)
+    cctx = ar->cctxs[--ar->ncctxs];
+  pthread_mutex_unlock(&ar->lock);
+
+  if(cctx == NULL && (cctx = ZSTD_createCCtx()) == NULL)
+    fprintf(stderr, "Out of memory\n");
+
+  return cctx;
+}
+
+/*! Give back a compression context from far_cctx_get
+ *
+ *  @param[in] ar   Archive
+ *  @param[in] cctx Context
+ */
+static void
+far_cctx_put(far_archive_t *ar,
+             ZSTD_CCtx     *cctx)
+{
+  pthread_mutex_lock(&ar->lock);
+  ar->cctxs[ar->ncctxs++] = cctx;
+  pthread_mutex_unlock(&ar->lock);
+}
+
+/*! Compress a small file with the dictionary
+ *
+ *  The file is only stored compressed if that makes it smaller.
+ *
+ *  @param[in] ar   Archive
+ *  @param[in] node Index of node
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+far_pack_node(far_archive_t *ar,
+              size_t        node)
+{
+  far_node_t *n = ar->nodes + node;
+  char       buffer[FAR_ZSTD_MAX], *packed;
+  ZSTD_CCtx  *cctx;
+  size_t     rc;
+
+  if(far_read_node(ar, n, buffer) != 0)
+    return -1;
+
+  packed = (char*)malloc(ZSTD_compressBound(n->size));
+  if(packed == NULL)
+  {
+    perror("malloc");
+    return -1;
+  }
+
+  cctx = far_cctx_get(ar);
+  if(cctx == NULL)
+  {
+    free(packed);
+    return -1;
+  }
+
+  rc = ZSTD_compress_usingCDict(cctx, packed, ZSTD_compressBound(n->size),
+                                buffer, n->size, ar->cdict);
+  far_cctx_put(ar, cctx);
+
+  if(ZSTD_isError(rc))
+  {
+    fprintf(stderr, "%s: %s\n", n->path, ZSTD_getErrorName(rc));
+    free(packed);
+    return -1;
+  }
+
+  if(sizeof(FARzstd_t) + rc >= n->size)
+  {
+    free(packed);
+    return 0;
+  }
+
+  n->packed   = packed;
+  n->packsize = rc;
+  return 0;
+}
+
+/*! Train a dictionary on the small files and compress them with it
+ *
+ *  Small files barely compress on their own, but they tend to share most
+ *  of their structure with each other, which the dictionary captures.
+ *  Without enough small files to train on, everything is stored as is.
+ *
+ *  @param[in] ar Archive
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+far_compress(far_archive_t *ar)
+{
+  far_node_t *node;
+  size_t     *nodes, *sizes, i, n = 0, nsamples = 0, total = 0, step, rc, saved = 0;
+  char       *samples;
+
+  nodes = (size_t*)malloc(ar->nnodes * sizeof(size_t) + 1);
+  if(nodes == NULL)
+  {
+    fprintf(stderr, "Out of memory\n");
+    return -1;
+  }
+
+  for(i = 0; i < ar->nnodes; ++i)
+  {
+    node = ar->nodes + i;
+    if(!node->isdir && !node->dup && node->chunks == NULL && !node->block
+    && node->payload == NULL && node->size != 0 && node->size <= FAR_ZSTD_MAX)
+    {
+      nodes[n++] = i;
+      total += node->size;
+    }
+  }
+
+  if(n == 0)
+  {
+    free(nodes);
+    return 0;
+  }
+
+  sizes    = (size_t*)malloc(n * sizeof(size_t));
+  samples  = (char*)malloc(FAR_ZSTD_SAMPLES + FAR_ZSTD_MAX);
+  ar->dict = (char*)malloc(FAR_ZSTD_DICT);
+  if(sizes == NULL || samples == NULL || ar->dict == NULL)
+  {
+    fprintf(stderr, "Out of memory\n");
+    free(samples);
+    free(sizes);
+    free(nodes);
+    return -1;
+  }
+
+  /* spread the samples over the whole tree when it has too much to use */
+  step = total / FAR_ZSTD_SAMPLES + 1;
+  for(i = 0, total = 0; i < n && total < FAR_ZSTD_SAMPLES; i += step)
+  {
+    node = ar->nodes + nodes[i];
+    if(far_read_node(ar, node, samples + total) != 0)
+    {
+      free(samples);
+      free(sizes);
+      free(nodes);
+      return -1;
+    }
+
+    sizes[nsamples++] = node->size;
+    total += node->size;
+  }
+
+  rc = ZDICT_trainFromBuffer(ar->dict, FAR_ZSTD_DICT, samples, sizes, nsamples);
+  free(samples);
+  free(sizes);
+
+  if(ZDICT_isError(rc))
+  {
+    fprintf(stderr, "Not compressing: %s\n", ZDICT_getErrorName(rc));
+    free(nodes);
+    return 0;
+  }
+  ar->dictsize = rc;
+
+  ar->cdict = ZSTD_createCDict(ar->dict, ar->dictsize, FAR_ZSTD_LEVEL);
+  if(ar->cdict == NULL)
+  {
+    fprintf(stderr, "Out of memory\n");
+    free(nodes);
+    return -1;
+  }
+
+  rc = far_parallel(ar, far_pack_node, nodes, n);
+
+  for(i = 0; i < n; ++i)
+  {
+    node = ar->nodes + nodes[i];
+    if(node->packed != NULL)
+      saved += node->size - (sizeof(FARzstd_t) + node->packsize);
+  }
+
+  /* the dictionary is only worth storing if it saves more than it takes */
+  if(rc == 0 && saved <= ar->dictsize)
+  {
+    fprintf(stderr, "Not compressing: %zu bytes saved with a %zu byte dictionary\n",
+            saved, ar->dictsize);
+    for(i = 0; i < n; ++i)
+    {
+      node = ar->nodes + nodes[i];
+      free(node->packed);
+      node->packed   = NULL;
+      node->packsize = 0;
+    }
+    ar->dictsize = 0;
+  }
+  free(nodes);
+
+  return rc == 0 ? 0 : -1;
+}
+
+/*! Build the dictionary section
+ *
+ *  @param[in] ar      Archive
+ *  @param[in] meta    Metadata buffer to append to
+ *  @param[in] section Section descriptor to fill
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+far_build_dict(far_archive_t *ar,
+               far_buf_t     *meta,
+               FARsection_t  *section)
+{
+  char *dict;
+
+  section->type   = cpu_to_le32(FAR_SECTION_DICT);
+  section->offset = cpu_to_le32(meta->size);
+  section->size   = cpu_to_le32(ar->dictsize);
+
+  dict = (char*)far_buf_append(meta, ar->dictsize);
+  if(dict == NULL)
+    return -1;
+
+  memcpy(dict, ar->dict, ar->dictsize);
+  return 0;
+}
+
+/*! Read a tiny file to store inline
+ *
+ *  @param[in] ar   Archive
+ *  @param[in] node Index of node
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+far_read_payload(far_archive_t *ar,
+                 size_t        node)
+{
+  far_node_t *n = ar->nodes + node;
+
+  n->payload = (char*)malloc(n->size);
+  if(n->payload == NULL)
+  {
+    perror("malloc");
+    return -1;
+  }
+
+  return far_read_node(ar, n, n->payload);
+}
+
+/*! Store tiny files inline among the names
+ *
+ *  @param[in] ar Archive
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+far_inline(far_archive_t *ar)
+{
+  far_node_t *node;
+  size_t     *nodes, i, n = 0;
+  int        rc;
+
+  nodes = (size_t*)malloc(ar->nnodes * sizeof(size_t) + 1);
+  if(nodes == NULL)
+  {
+    fprintf(stderr, "Out of memory\n");
+    return -1;
+  }
+
+  for(i = 0; i < ar->nnodes; ++i)
+  {
+    node = ar->nodes + i;
+    if(!node->isdir && !node->dup && node->size != 0 && node->size <= FAR_INLINE_MAX)
+      nodes[n++] = i;
+  }
+
+  rc = far_parallel(ar, far_read_payload, nodes, n);
+  free(nodes);
+
+  return rc;
+}
+
+/*! Compress a solid block
+ *
+ *  @param[in] ar    Archive
+ *  @param[in] block Index of block
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+far_pack_block(far_archive_t *ar,
+               size_t        block)
+{
+  far_block_t *b = ar->blocks + block;
+  far_node_t  *node;
+  char        *buffer;
+  ZSTD_CCtx   *cctx;
+  size_t      i, done, rc;
+
+  buffer   = (char*)malloc(b->size);
+  b->packed = (char*)malloc(ZSTD_compressBound(b->size));
+  if(buffer == NULL || b->packed == NULL)
+  {
+    perror("malloc");
+    free(buffer);
+    return -1;
+  }
+
+  /* the block's files are in table order, among other nodes */
+  for(i = b->first, done = 0; done < b->size; ++i)
+  {
+    node = ar->nodes + i;
+    if(node->block != block + 1)
+      continue;
+
+    if(far_read_node(ar, node, buffer + node->dataoff - b->start) != 0)
+    {
+      free(buffer);
+      return -1;
+    }
+    done += node->size;
+  }
+
+  cctx = far_cctx_get(ar);
+  if(cctx == NULL)
+  {
+    free(buffer);
+    return -1;
+  }
+
+  rc = ZSTD_compressCCtx(cctx, b->packed, ZSTD_compressBound(b->size),
+                         buffer, b->size, FAR_ZSTD_LEVEL);
+  far_cctx_put(ar, cctx);
+  free(buffer);
+
+  if(ZSTD_isError(rc))
+  {
+    fprintf(stderr, "Solid block %zu: %s\n", block, ZSTD_getErrorName(rc));
+    return -1;
+  }
+
+  b->packsize = rc;
+  return 0;
+}
+
+/*! Pack small files into solid blocks
+ *
+ *  Runs of small files in table order, which keeps each directory's files
+ *  together, are compressed as one frame of up to FAR_SOLID_MAX bytes, so
+ *  they compress against each other. A small file's dataoff is set to its
+ *  offset into the solid stream.
+ *
+ *  @param[in] ar Archive
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+far_solid(far_archive_t *ar)
+{
+  far_node_t *node;
+  size_t     *blocks, i;
+  uint64_t   stream = 0;
+  int        rc;
+
+  /* no more blocks than small files */
+  ar->blocks = (far_block_t*)calloc(ar->nnodes + 1, sizeof(far_block_t));
+  if(ar->blocks == NULL)
+  {
+    fprintf(stderr, "Out of memory\n");
+    return -1;
+  }
+
+  for(i = 0; i < ar->nnodes; ++i)
+  {
+    node = ar->nodes + i;
+    if(node->isdir || node->dup || node->chunks != NULL || node->payload != NULL
+    || node->size == 0 || node->size > FAR_SOLID_FILE)
+      continue;
+
+    if(ar->nblocks == 0
+    || ar->blocks[ar->nblocks-1].size + node->size > FAR_SOLID_MAX)
+    {
+      ar->blocks[ar->nblocks].first = i;
+      ar->blocks[ar->nblocks].start = stream;
+      ar->nblocks += 1;
+    }
+
+    node->block   = ar->nblocks;
+    node->dataoff = stream;
+    ar->blocks[ar->nblocks-1].size += node->size;
+    stream += node->size;
+  }
+
+  if(stream > UINT32_MAX)
+  {
+    fprintf(stderr, "Archive too large\n");
+    return -1;
+  }
+
+  blocks = (size_t*)malloc(ar->nblocks * sizeof(size_t) + 1);
+  if(blocks == NULL)
+  {
+    fprintf(stderr, "Out of memory\n");
+    return -1;
+  }
+
+  for(i = 0; i < ar->nblocks; ++i)
+    blocks[i] = i;
+
+  rc = far_parallel(ar, far_pack_block, blocks, ar->nblocks);
+  free(blocks);
+
+  return rc;
+}
+
+/*! Build the solid block section
+ *
+ *  The section is filled in by far_fill_blocks once the blocks have been
+ *  placed.
+ *
+ *  @param[in] ar      Archive
+ *  @param[in] meta    Metadata buffer to append to
+ *  @param[in] section Section descriptor to fill
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+far_build_blocks(far_archive_t *ar,
+                 far_buf_t     *meta,
+                 FARsection_t  *section)
+{
+  section->type   = cpu_to_le32(FAR_SECTION_BLOCKS);
+  section->offset = cpu_to_le32(meta->size);
+  section->size   = cpu_to_le32(ar->nblocks * sizeof(FARblock_t));
+
+  if(far_buf_append(meta, ar->nblocks * sizeof(FARblock_t)) == NULL)
+    return -1;
+
+  return 0;
+}
+
+/*! Fill in the solid block section
+ *
+ *  @param[in] ar     Archive
+ *  @param[in] blocks Solid block section
+ */
+static void
+far_fill_blocks(far_archive_t *ar,
+                FARblock_t    *blocks)
+{
+  size_t i;
+
+  for(i = 0; i < ar->nblocks; ++i)
+  {
+    blocks[i].offset = cpu_to_le32(ar->blocks[i].dataoff);
+    blocks[i].size   = cpu_to_le32(ar->blocks[i].packsize);
+    blocks[i].end    = cpu_to_le32(ar->blocks[i].start + ar->blocks[i].size);
+  }
+}
+
+/*! Write a compressed file to the archive
+ *
+ *  The record is aligned, so pad up to where it was placed.
+ *
+ *  @param[in] node Node of file
+ *  @param[in] fp   Archive being written
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+far_write_packed(const far_node_t *node,
+                 FILE             *fp)
+{
+  FARzstd_t record;
+  long      pos;
+
+  for(pos = ftell(fp); pos >= 0 && pos < node->dataoff; ++pos)
+  {
+    if(fputc(0, fp) == EOF)
+      return -1;
+  }
+
+  record.size = cpu_to_le32(node->packsize);
+  if(pos != node->dataoff
+  || fwrite(&record, 1, sizeof(record), fp) != sizeof(record)
+  || fwrite(node->packed, 1, node->packsize, fp) != node->packsize)
+  {
+    perror("fwrite");
+    return -1;
+  }
+
+  return 0;
+}
+
+/*! Write a solid block to the archive, unless it already was
+ *
+ *  @param[in] block Block
+ *  @param[in] fp    Archive being written
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+far_write_block(far_block_t *block,
+                FILE        *fp)
+{
+  if(block->written)
+    return 0;
+
+  if(fwrite(block->packed, 1, block->packsize, fp) != block->packsize)
+  {
+    perror("fwrite");
+    return -1;
+  }
+
+  block->written = 1;
+  return 0;
+}
+
+/*! Copy a file's contents to the archive
+ *
+ *  @param[in] ar   Archive
+ *  @param[in] node Node of file
+ *  @param[in] fp   Archive being written
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+far_copy_file(far_archive_t    *ar,
+              const far_node_t *node,
+              FILE             *fp)
+{
+  char     buffer[65536], *path;
+  ssize_t  rc;
+  uint64_t total = 0;
+  int      fd;
+
+  fd = far_open_node(ar, node, &path);
+  if(fd < 0)
+    return -1;
+
+  while((rc = read(fd, buffer, sizeof(buffer))) > 0)
+  {
+    total += rc;
+    if(total > node->size || fwrite(buffer, 1, rc, fp) != (size_t)rc)
+      break;
+  }
+
+  close(fd);
+
+  if(rc < 0 || total != node->size)
+  {
+    fprintf(stderr, "%s: %s\n", path, rc < 0 ? strerror(errno) : "file changed while reading");
+    free(path);
+    return -1;
+  }
+
+  free(path);
+  return 0;
+}
+
+/*! Write the archive
+ *
+ *  @param[in] ar      Archive
+ *  @param[in] outfile Path to write to
+ *
+ *  @returns 0 for success
+ *  @returns -1 for failure
+ */
+static int
+far_write(far_archive_t *ar,
+          const char    *outfile)
+{
+  far_buf_t     meta = { NULL, 0, 0 };
+  FARheader_t   *hdr;
+  FARheader1_t  *hdr1;
+  FARentry_t    *entry;
+  FARsection_t  sections[5];
+  far_chunk_t   *chunk;
+  far_block_t   *block;
+  size_t        i, j, hdrsize, entryoff, nameoff;
+  uint32_t      nsections = 0, flags = FAR_HEADER_SORTED;
+  uint64_t      dataoff;
+  FILE          *fp;
+  int           rc;
+
+  if(ar->frontcode)
+    flags |= FAR_HEADER_FRONTCODED;
+
+  /* header, then entry table, then names, then sections */
+  if(ar->version == FAR_VERSION_0)
+    hdrsize = sizeof(FARheader_t);
+  else
+  {
+    nsections = ar->frontcode + (ar->phash && ar->nnodes != 0) + (ar->nchunks != 0)
+              + (ar->dictsize != 0) + (ar->nblocks != 0);
+    hdrsize   = sizeof(FARheader1_t) + nsections * sizeof(FARsection_t);
+  }
+
+  entryoff = hdrsize;
+  nameoff  = entryoff + ar->nnodes * sizeof(FARentry_t);
+  if(far_buf_append(&meta, nameoff) == NULL
+  || far_build_names(ar, &meta) != 0)
+    goto nomem;
+
+  hdr = (FARheader_t*)meta.data;
+  hdr->magic       = cpu_to_le32(FAR_MAGIC);
+  hdr->version     = cpu_to_le32(ar->version);
+  hdr->nentries    = cpu_to_le32(ar->nnodes);
+  hdr->namesize    = cpu_to_le32(meta.size - nameoff);
+  hdr->rootentries = cpu_to_le32(ar->rootnodes);
+
+  if(ar->version == FAR_VERSION_1)
+  {
+    nsections = 0;
+    if(far_buf_align(&meta, sizeof(uint32_t)) != 0)
+      goto nomem;
+
+    if(ar->frontcode && far_build_namehash(ar, &meta, &sections[nsections++]) != 0)
+      goto nomem;
+
+    if(ar->phash && ar->nnodes != 0
+    && far_build_phash(ar, &meta, &sections[nsections++]) != 0)
+      goto nomem;
+
+    if(ar->nchunks != 0
+    && (far_buf_align(&meta, sizeof(uint32_t)) != 0
+        || far_build_chunks(ar, &meta, &sections[nsections++]) != 0))
+      goto nomem;
+
+    if(ar->dictsize != 0 && far_build_dict(ar, &meta, &sections[nsections++]) != 0)
+      goto nomem;
+
+    if(ar->nblocks != 0
+    && (far_buf_align(&meta, sizeof(uint32_t)) != 0
+        || far_build_blocks(ar, &meta, &sections[nsections++]) != 0))
+      goto nomem;
+
+    hdr1 = (FARheader1_t*)meta.data;
+    hdr1->flags     = cpu_to_le32(flags);
+    hdr1->entryoff  = cpu_to_le32(entryoff);
+    hdr1->nsections = cpu_to_le32(nsections);
+    memcpy(hdr1->sections, sections, nsections * sizeof(FARsection_t));
+  }
+
+  /* file data follows the metadata */
+  if(far_buf_align(&meta, 16) != 0)
+    goto nomem;
+
+  /* a duplicate comes after the file it shares data with, a chunk or a
+   * solid block is placed where it is first used, and compressed records
+   * are aligned; inline files were placed with the names
+   */
+  for(i = 0, dataoff = meta.size; i < ar->nnodes; ++i)
+  {
+    if(ar->nodes[i].dup)
+      ar->nodes[i].dataoff = ar->nodes[ar->nodes[i].dup - 1].dataoff;
+    else if(ar->nodes[i].chunks != NULL)
+    {
+      for(j = 0; j < ar->nodes[i].nchunks; ++j)
+      {
+        chunk = ar->chunks + ar->nodes[i].chunks[j];
+        if(chunk->dataoff == 0)
+        {
+          chunk->dataoff = dataoff;
+          dataoff += chunk->size;
+        }
+      }
+    }
+    else if(ar->nodes[i].payload != NULL)
+      continue;
+    else if(ar->nodes[i].block)
+    {
+      block = ar->blocks + ar->nodes[i].block - 1;
+      if(block->dataoff == 0)
+      {
+        block->dataoff = dataoff;
+        dataoff += block->packsize;
+      }
+    }
+    else if(ar->nodes[i].packed != NULL)
+    {
+      dataoff = (dataoff + sizeof(uint32_t) - 1) & ~(uint64_t)(sizeof(uint32_t) - 1);
+      ar->nodes[i].dataoff = dataoff;
+      dataoff += sizeof(FARzstd_t) + ar->nodes[i].packsize;
+    }
+    else if(!ar->nodes[i].isdir)
+    {
+      ar->nodes[i].dataoff = dataoff;
+      dataoff += ar->nodes[i].size;
+    }
+  }
+
+  if(dataoff > UINT32_MAX)
+  {
+    fprintf(stderr, "Archive too large\n");
+    free(meta.data);
+    return -1;
+  }
+
+  for(i = 0; i < nsections; ++i)
+  {
+    if(le32_to_cpu(sections[i].type) == FAR_SECTION_CHUNKS)
+      far_fill_chunks(ar, (FARchunk_t*)(meta.data + le32_to_cpu(sections[i].offset)));
+    else if(le32_to_cpu(sections[i].type) == FAR_SECTION_BLOCKS)
+      far_fill_blocks(ar, (FARblock_t*)(meta.data + le32_to_cpu(sections[i].offset)));
+  }
+
+  entry = (FARentry_t*)(meta.data + entryoff);
+  for(i = 0; i < ar->nnodes; ++i, ++entry)
+  {
+    const far_node_t *node = ar->nodes + i, *data;
+
+    entry->nameoff = cpu_to_le32(node->nameoff);
+    if(node->isdir)
+    {
+      entry->flags   = cpu_to_le32(FAR_DIR_TYPE);
+      entry->dataoff = cpu_to_le32(entryoff + node->first * sizeof(FARentry_t));
+      entry->size    = cpu_to_le32(node->nchildren);
+    }
+    else
+    {
+      /* a duplicate of a chunked, compressed or solid file shares its record */
+      data = node->dup ? ar->nodes + node->dup - 1 : node;
+
+      entry->flags   = cpu_to_le32(FAR_FILE_TYPE
+                                   | (data->chunks ? FAR_ENTRY_CHUNKED : 0)
+                                   | (data->packed ? FAR_ENTRY_ZSTD : 0)
+                                   | (data->block ? FAR_ENTRY_SOLID : 0)
+                                   | (data->payload ? FAR_ENTRY_INLINE : 0));
+      entry->dataoff = cpu_to_le32(node->dataoff);
+      entry->size    = cpu_to_le32(node->size);
+    }
+  }
+
+  fp = fopen(outfile, "wb");
+  if(fp == NULL)
+  {
+    perror(outfile);
+    free(meta.data);
+    return -1;
+  }
+
+  if(fwrite(meta.data, 1, meta.size, fp) != meta.size)
+  {
+    perror(outfile);
+    fclose(fp);
+    free(meta.data);
+    return -1;
+  }
+  free(meta.data);
+
+  for(i = 0; i < ar->nnodes; ++i)
+  {
+    if(ar->nodes[i].isdir || ar->nodes[i].dup || ar->nodes[i].payload != NULL)
+      continue;
+
+    if(ar->nodes[i].chunks != NULL)
+      rc = far_copy_chunks(ar, ar->nodes + i, fp);
+    else if(ar->nodes[i].packed != NULL)
+      rc = far_write_packed(ar->nodes + i, fp);
+    else if(ar->nodes[i].block)
+      rc = far_write_block(ar->blocks + ar->nodes[i].block - 1, fp);
+    else
+      rc = far_copy_file(ar, ar->nodes + i, fp);
+
+    if(rc != 0)
+    {
+      fclose(fp);
+      return -1;
+    }
+  }
+
+  if(fclose(fp) != 0)
+  {
+    perror(outfile);
+    return -1;
+  }
+
+  return 0;
+
+nomem:
+  fprintf(stderr, "Out of memory\n");
+  free(meta.data);
+  return -1;
+}
+
+/*! Print usage
+ *
+ *  @param[in] prog Program name
+ */
+static void
+usage(const char *prog)
+{
+  fprintf(stderr,
+          "Usage: %s [options] <directory> <archive>\n"
+          "\n"
+          "Options:\n"
+          "  -0     write a version 0 archive, with plain names\n"
+          "  -c     split large files into chunks shared between files\n"
+          "  -d     store files with identical contents once\n"
+          "  -i     store files of up to 64 bytes next to their names\n"
+          "  -j <n> threads hashing files for -d, reading them for -i and compressing\n"
+          "         for -s and -z\n"
+          "         (default: one per CPU)\n"
+          "  -p     include a perfect hash over full paths\n"
+          "  -s     compress small files together in solid blocks\n"
+          "  -z     compress small files with a dictionary trained on them\n",
+          prog);
+}
+
+int main(int argc, char *argv[])
+{
+  far_archive_t ar;
+  int           opt, rc;
+  size_t        i;
+
+  memset(&ar, 0, sizeof(ar));
+  ar.version   = FAR_VERSION_1;
+  ar.frontcode = 1;
+  pthread_mutex_init(&ar.lock, NULL);
+
+  while((opt = getopt(argc, argv, "0cdij:psz")) != -1)
+  {
+    switch(opt)
+    {
+      case '0':
+        ar.version   = FAR_VERSION_0;
+        ar.frontcode = 0;
+        break;
+
+      case 'c':
+        ar.chunk = 1;
+        break;
+
+      case 'd':
+        ar.dedup = 1;
+        break;
+
+      case 'i':
+        ar.tiny = 1;
+        break;
+
+      case 'j':
+        ar.threads = strtoul(optarg, NULL, 0);
+        break;
+
+      case 'p':
+        ar.phash = 1;
+        break;
+
+      case 's':
+        ar.solid = 1;
+        break;
+
+      case 'z':
+        ar.zstd = 1;
+        break;
+
+      default:
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+
+  if(argc - optind != 2)
+  {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if(ar.version == FAR_VERSION_0 && ar.phash)
+  {
+    fprintf(stderr, "Version 0 archives cannot hold a perfect hash\n");
+    return EXIT_FAILURE;
+  }
+
+  if(ar.version == FAR_VERSION_0 && ar.chunk)
+  {
+    fprintf(stderr, "Version 0 archives cannot hold chunks\n");
+    return EXIT_FAILURE;
+  }
+
+  if(ar.version == FAR_VERSION_0 && ar.tiny)
+  {
+    fprintf(stderr, "Version 0 archives cannot hold inline files\n");
+    return EXIT_FAILURE;
+  }
+
+  if(ar.version == FAR_VERSION_0 && (ar.zstd || ar.solid))
+  {
+    fprintf(stderr, "Version 0 archives cannot hold compressed files\n");
+    return EXIT_FAILURE;
+  }
+
+  if(ar.zstd && ar.solid)
+  {
+    fprintf(stderr, "-s and -z are alternatives; pick one\n");
+    return EXIT_FAILURE;
+  }
+
+  if(ar.threads == 0)
+    ar.threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if(ar.threads < 1)
+    ar.threads = 1;
+  if(ar.threads > FAR_MAX_THREADS)
+    ar.threads = FAR_MAX_THREADS;
+
+  ar.srcdir = argv[optind];
+
+  rc = far_scan(&ar);
+  if(rc == 0 && ar.nnodes > UINT32_MAX / sizeof(FARentry_t))
+  {
+    fprintf(stderr, "Too many entries\n");
+    rc = -1;
+  }
+  if(rc == 0 && ar.dedup)
+    rc = far_dedup(&ar);
+  if(rc == 0 && ar.chunk)
+    rc = far_chunk(&ar);
+  if(rc == 0 && ar.tiny)
+    rc = far_inline(&ar);
+  if(rc == 0 && ar.solid)
+    rc = far_solid(&ar);
+  if(rc == 0 && ar.zstd)
+    rc = far_compress(&ar);
+  if(rc == 0)
+    rc = far_write(&ar, argv[optind+1]);
+
+  for(i = 0; i < ar.nnodes; ++i)
+  {
+    free(ar.nodes[i].name);
+    free(ar.nodes[i].path);
+    free(ar.nodes[i].chunks);
+    free(ar.nodes[i].packed);
+    free(ar.nodes[i].payload);
+  }
+  free(ar.nodes);
+  free(ar.chunks);
+  free(ar.chunkhash);
+  for(i = 0; i < ar.nblocks; ++i)
+    free(ar.blocks[i].packed);
+  free(ar.blocks);
+  free(ar.dict);
+  ZSTD_freeCDict(ar.cdict);
+  while(ar.ncctxs != 0)
+    ZSTD_freeCCtx(ar.cctxs[--ar.ncctxs]);
+  pthread_mutex_destroy(&ar.lock);
+
+  return rc == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}